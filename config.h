@@ -0,0 +1,26 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in.  Generated from configure.ac by autoheader.  */
+
+/* Define to 1 if you have cvc5. */
+/* #undef HAVE_LIBCVC5 */
+
+/* Define to 1 if you have z3. */
+#define HAVE_LIBZ3 1
+
+/* Define to the address where bug reports for this package should be sent. */
+#define PACKAGE_BUGREPORT ""
+
+/* Define to the full name of this package. */
+#define PACKAGE_NAME "smtgcc"
+
+/* Define to the full name and version of this package. */
+#define PACKAGE_STRING "smtgcc 0.0"
+
+/* Define to the one symbol short name of this package. */
+#define PACKAGE_TARNAME "smtgcc"
+
+/* Define to the home page for this package. */
+#define PACKAGE_URL ""
+
+/* Define to the version of this package. */
+#define PACKAGE_VERSION "0.0"
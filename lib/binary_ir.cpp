@@ -0,0 +1,571 @@
+// Reading and writing the binary IR format.
+//
+// The file is a sequence of little-endian 32-bit words:
+//
+//   "SMTGCCIR" (2 words), version, ptr_bits, ptr_id_bits, ptr_offset_bits,
+//   nof_functions, and for each function:
+//     name length (in bytes), name (padded to a multiple of 4 bytes),
+//     nof_bbs, nof_insts,
+//     nof_phis and nof_insts for each BB,
+//     the instructions, in the order the BBs are stored, with the phi
+//       nodes before the other instructions of the BB,
+//     the phi arguments, for each phi node in the same order.
+//
+// An instruction starts with one word containing the opcode and number of
+// arguments (opcode | nof_args << 8) followed by the bitsize. Then follows
+// the arguments as indices into the function's instructions, except that
+// VALUE is followed by the value (4 words, least significant first), and
+// the BB operands of BR are indices into the function's BBs. The phi
+// arguments are stored as the number of arguments followed by
+// (instruction, BB) index pairs.
+//
+// The instructions (except phi nodes) may only use instructions that come
+// earlier in the file, which is the case for IR in reverse post order.
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "smtgcc.h"
+
+using namespace std::string_literals;
+
+namespace smtgcc {
+namespace {
+
+const char magic[8] = {'S', 'M', 'T', 'G', 'C', 'C', 'I', 'R'};
+const uint32_t version = 2;
+
+static_assert(std::endian::native == std::endian::little);
+
+class Writer {
+  std::vector<uint32_t> words;
+  Inst_map<uint32_t> inst2idx;
+  Bb_map<uint32_t> bb2idx;
+
+  void write_function(Function *func);
+  void write_inst(Instruction *inst);
+  void write_string(const std::string& str);
+
+public:
+  void write_module(Module *module, FILE *stream);
+};
+
+void Writer::write_string(const std::string& str)
+{
+  words.push_back(str.size());
+  size_t idx = words.size();
+  words.resize(idx + (str.size() + 3) / 4);
+  memcpy(&words[idx], str.data(), str.size());
+}
+
+void Writer::write_inst(Instruction *inst)
+{
+  words.push_back((uint32_t)inst->opcode | (uint32_t)inst->nof_args << 8);
+  words.push_back(inst->bitsize);
+  if (inst->opcode == Op::VALUE)
+    {
+      unsigned __int128 value = inst->value();
+      for (int i = 0; i < 4; i++)
+	words.push_back(value >> (i * 32));
+    }
+  else if (inst->opcode == Op::BR)
+    {
+      if (inst->nof_args == 0)
+	words.push_back(bb2idx.at(inst->u.br1.dest_bb));
+      else
+	{
+	  words.push_back(inst2idx.at(inst->arguments[0]));
+	  words.push_back(bb2idx.at(inst->u.br3.true_bb));
+	  words.push_back(bb2idx.at(inst->u.br3.false_bb));
+	}
+    }
+  else
+    {
+      for (uint16_t i = 0; i < inst->nof_args; i++)
+	{
+	  if (!inst2idx.contains(inst->arguments[i]))
+	    throw Not_implemented("write_binary_ir: use before definition");
+	  words.push_back(inst2idx.at(inst->arguments[i]));
+	}
+    }
+}
+
+void Writer::write_function(Function *func)
+{
+  inst2idx.clear();
+  bb2idx.clear();
+
+  write_string(func->name);
+  words.push_back(func->bbs.size());
+  size_t nof_insts_idx = words.size();
+  words.push_back(0);
+  uint32_t nof_insts = 0;
+  for (auto bb : func->bbs)
+    {
+      uint32_t nof_bb_insts = 0;
+      for (Instruction *inst = bb->first_inst; inst; inst = inst->next)
+	nof_bb_insts++;
+      words.push_back(bb->phis.size());
+      words.push_back(nof_bb_insts);
+      nof_insts += bb->phis.size() + nof_bb_insts;
+    }
+  words[nof_insts_idx] = nof_insts;
+  for (size_t i = 0; i < func->bbs.size(); i++)
+    bb2idx[func->bbs[i]] = i;
+
+  uint32_t inst_idx = 0;
+  for (auto bb : func->bbs)
+    {
+      for (auto phi : bb->phis)
+	{
+	  write_inst(phi);
+	  inst2idx[phi] = inst_idx++;
+	}
+      for (Instruction *inst = bb->first_inst; inst; inst = inst->next)
+	{
+	  write_inst(inst);
+	  inst2idx[inst] = inst_idx++;
+	}
+    }
+
+  for (auto bb : func->bbs)
+    {
+      for (auto phi : bb->phis)
+	{
+	  words.push_back(phi->phi_args.size());
+	  for (auto [arg_inst, arg_bb] : phi->phi_args)
+	    {
+	      words.push_back(inst2idx.at(arg_inst));
+	      words.push_back(bb2idx.at(arg_bb));
+	    }
+	}
+    }
+}
+
+void Writer::write_module(Module *module, FILE *stream)
+{
+  uint32_t magic_words[2];
+  memcpy(magic_words, magic, sizeof(magic));
+  words.push_back(magic_words[0]);
+  words.push_back(magic_words[1]);
+  words.push_back(version);
+  words.push_back(module->ptr_bits);
+  words.push_back(module->ptr_id_bits);
+  words.push_back(module->ptr_offset_bits);
+  words.push_back(module->functions.size());
+  for (auto func : module->functions)
+    write_function(func);
+
+  fwrite(words.data(), sizeof(uint32_t), words.size(), stream);
+}
+
+class Reader {
+  const uint32_t *pos;
+  const uint32_t *end;
+  std::vector<Basic_block *> bbs;
+  std::vector<Instruction *> insts;
+
+  uint32_t get_word();
+  Instruction *get_inst();
+  Basic_block *get_bb();
+  void check_args(Op opcode, Instruction *const *args, uint32_t nof_args);
+  void read_inst(Basic_block *bb);
+  void read_function(Module *module);
+
+public:
+  Reader(const void *data, size_t size)
+    : pos{(const uint32_t *)data}
+    , end{(const uint32_t *)data + size / sizeof(uint32_t)}
+  {}
+  Module *read_module();
+};
+
+uint32_t Reader::get_word()
+{
+  if (pos == end)
+    throw Parse_error("unexpected end of file", 0);
+  return *pos++;
+}
+
+Instruction *Reader::get_inst()
+{
+  uint32_t idx = get_word();
+  if (idx >= insts.size() || !insts[idx])
+    throw Parse_error("invalid instruction index", 0);
+  return insts[idx];
+}
+
+Basic_block *Reader::get_bb()
+{
+  uint32_t idx = get_word();
+  if (idx >= bbs.size())
+    throw Parse_error("invalid basic block index", 0);
+  return bbs[idx];
+}
+
+// Check that the arguments are valid for opcode, so that malformed input
+// is reported as a Parse_error instead of failing the asserts when the
+// instruction is created.
+void Reader::check_args(Op opcode, Instruction *const *args,
+			uint32_t nof_args)
+{
+  for (uint32_t i = 0; i < nof_args; i++)
+    {
+      if (!args[i]->has_lhs())
+	throw Parse_error("invalid argument", 0);
+    }
+
+  Module *module = args[0]->bb->func->module;
+  Inst_class iclass = inst_info[(int)opcode].iclass;
+  auto is_value = [](const Instruction *inst) {
+    return inst->opcode == Op::VALUE;
+  };
+  bool valid = true;
+  if (nof_args == 1)
+    {
+      if (opcode == Op::NAN || opcode == Op::REGISTER)
+	valid = is_value(args[0]) && args[0]->value() > 0;
+      else if (opcode == Op::READ)
+	valid = args[0]->opcode == Op::REGISTER;
+    }
+  else if (nof_args == 2)
+    {
+      if (iclass == Inst_class::icomparison
+	  || iclass == Inst_class::fcomparison
+	  || opcode == Op::SADD_WRAPS
+	  || opcode == Op::SSUB_WRAPS
+	  || opcode == Op::SMUL_WRAPS)
+	valid = args[0]->bitsize == args[1]->bitsize;
+      else if (iclass == Inst_class::conv)
+	{
+	  valid = is_value(args[1]) && args[1]->value() > 0;
+	  if (valid && (opcode == Op::SEXT || opcode == Op::ZEXT))
+	    valid = args[1]->value() > args[0]->bitsize;
+	}
+      else if (opcode == Op::PARAM || opcode == Op::SYMBOLIC)
+	valid = is_value(args[0]) && is_value(args[1]) && args[1]->value() > 0;
+      else if (opcode == Op::STORE || opcode == Op::SET_MEM_UNDEF)
+	valid = args[0]->bitsize == module->ptr_bits && args[1]->bitsize == 8;
+      else if (opcode == Op::SET_MEM_FLAG)
+	valid = args[0]->bitsize == module->ptr_bits && args[1]->bitsize == 1;
+      else if (opcode == Op::WRITE)
+	valid = args[0]->opcode == Op::REGISTER;
+      else if (opcode != Op::CONCAT
+	       && opcode != Op::ARRAY_LOAD
+	       && opcode != Op::ARRAY_GET_UNDEF
+	       && opcode != Op::ARRAY_GET_FLAG
+	       && opcode != Op::ARRAY_GET_SIZE)
+	valid = args[0]->bitsize == args[1]->bitsize;
+    }
+  else if (nof_args == 3)
+    {
+      if (opcode == Op::EXTRACT)
+	valid = is_value(args[1]) && is_value(args[2])
+	  && args[1]->value() >= args[2]->value()
+	  && args[1]->value() < args[0]->bitsize;
+      else if (opcode == Op::MEMORY)
+	valid = is_value(args[0]) && is_value(args[1]) && is_value(args[2])
+	  && args[0]->bitsize == module->ptr_id_bits
+	  && args[1]->bitsize == module->ptr_offset_bits;
+      else if (opcode == Op::ITE)
+	valid = args[0]->bitsize == 1 && args[1]->bitsize == args[2]->bitsize;
+    }
+  if (!valid)
+    throw Parse_error("invalid arguments for "s + inst_info[(int)opcode].name,
+		      0);
+}
+
+void Reader::read_inst(Basic_block *bb)
+{
+  uint32_t word = get_word();
+  uint32_t opcode_nbr = word & 0xff;
+  uint32_t nof_args = word >> 8;
+  uint32_t bitsize = get_word();
+  if (opcode_nbr >= inst_info.size() || nof_args > 3)
+    throw Parse_error("invalid instruction", 0);
+  if (bb->last_inst
+      && (bb->last_inst->opcode == Op::BR || bb->last_inst->opcode == Op::RET))
+    throw Parse_error("instruction after the end of the basic block", 0);
+  Op opcode = (Op)opcode_nbr;
+  Inst_class iclass = inst_info[opcode_nbr].iclass;
+  if ((opcode == Op::PARAM || opcode == Op::MEMORY || opcode == Op::VALUE)
+      && bb != bb->func->bbs[0])
+    throw Parse_error("invalid instruction", 0);
+
+  Instruction *inst;
+  if (opcode == Op::PHI)
+    {
+      if (nof_args != 0 || bitsize == 0)
+	throw Parse_error("invalid instruction", 0);
+      inst = bb->build_phi_inst(bitsize);
+    }
+  else if (opcode == Op::VALUE)
+    {
+      if (nof_args != 0 || bitsize == 0 || bitsize > 128)
+	throw Parse_error("invalid instruction", 0);
+      unsigned __int128 value = 0;
+      for (int i = 0; i < 4; i++)
+	value |= (unsigned __int128)get_word() << (i * 32);
+      inst = bb->value_inst(value, bitsize);
+    }
+  else if (opcode == Op::BR)
+    {
+      if (nof_args == 0)
+	inst = bb->build_br_inst(get_bb());
+      else if (nof_args == 1)
+	{
+	  Instruction *cond = get_inst();
+	  Basic_block *true_bb = get_bb();
+	  Basic_block *false_bb = get_bb();
+	  if (!cond->has_lhs() || cond->bitsize != 1 || true_bb == false_bb)
+	    throw Parse_error("invalid arguments for br", 0);
+	  inst = bb->build_br_inst(cond, true_bb, false_bb);
+	}
+      else
+	throw Parse_error("invalid instruction", 0);
+    }
+  else if (opcode == Op::RET)
+    {
+      Instruction *args[2];
+      for (uint32_t i = 0; i < nof_args; i++)
+	{
+	  args[i] = get_inst();
+	  if (!args[i]->has_lhs())
+	    throw Parse_error("invalid arguments for ret", 0);
+	}
+      if (nof_args == 0)
+	inst = bb->build_ret_inst();
+      else if (nof_args == 1)
+	inst = bb->build_ret_inst(args[0]);
+      else if (nof_args == 2 && args[0]->bitsize == args[1]->bitsize)
+	inst = bb->build_ret_inst(args[0], args[1]);
+      else
+	throw Parse_error("invalid arguments for ret", 0);
+    }
+  else
+    {
+      uint32_t expected_nof_args;
+      switch (iclass)
+	{
+	case Inst_class::nullary:
+	  expected_nof_args = 0;
+	  break;
+	case Inst_class::iunary:
+	case Inst_class::funary:
+	  expected_nof_args = 1;
+	  break;
+	case Inst_class::ibinary:
+	case Inst_class::fbinary:
+	case Inst_class::icomparison:
+	case Inst_class::fcomparison:
+	case Inst_class::conv:
+	  expected_nof_args = 2;
+	  break;
+	case Inst_class::ternary:
+	  expected_nof_args = 3;
+	  break;
+	default:
+	  throw Parse_error("invalid instruction", 0);
+	}
+      if (nof_args != expected_nof_args)
+	throw Parse_error("invalid number of arguments for "s
+			  + inst_info[opcode_nbr].name, 0);
+
+      Instruction *args[3];
+      for (uint32_t i = 0; i < nof_args; i++)
+	args[i] = get_inst();
+      if (nof_args > 0)
+	check_args(opcode, args, nof_args);
+
+      if (nof_args == 0)
+	inst = bb->build_inst(opcode);
+      else if (nof_args == 1)
+	inst = bb->build_inst(opcode, args[0]);
+      else if (nof_args == 2)
+	inst = bb->build_inst(opcode, args[0], args[1]);
+      else
+	inst = bb->build_inst(opcode, args[0], args[1], args[2]);
+    }
+
+  if (inst->bitsize != bitsize)
+    throw Parse_error("invalid bitsize", 0);
+  insts.push_back(inst);
+}
+
+void Reader::read_function(Module *module)
+{
+  uint32_t name_len = get_word();
+  size_t remaining = end - pos;
+  if (name_len > remaining * sizeof(uint32_t))
+    throw Parse_error("unexpected end of file", 0);
+  std::string name((const char *)pos, name_len);
+  pos += (name_len + 3) / 4;
+  Function *func = module->build_function(name);
+
+  uint32_t nof_bbs = get_word();
+  uint32_t nof_insts = get_word();
+  remaining = end - pos;
+  if (nof_bbs == 0 || nof_bbs > remaining || nof_insts > remaining)
+    throw Parse_error("invalid function", 0);
+  std::vector<std::pair<uint32_t, uint32_t>> bb_sizes;
+  bb_sizes.reserve(nof_bbs);
+  bbs.clear();
+  bbs.reserve(nof_bbs);
+  for (uint32_t i = 0; i < nof_bbs; i++)
+    {
+      uint32_t nof_phis = get_word();
+      uint32_t nof_bb_insts = get_word();
+      bb_sizes.push_back({nof_phis, nof_bb_insts});
+      bbs.push_back(func->build_bb());
+    }
+  insts.clear();
+  insts.reserve(nof_insts);
+
+  for (uint32_t i = 0; i < nof_bbs; i++)
+    {
+      auto [nof_phis, nof_bb_insts] = bb_sizes[i];
+      for (uint32_t j = 0; j < nof_phis + nof_bb_insts; j++)
+	{
+	  read_inst(bbs[i]);
+	  if ((insts.back()->opcode == Op::PHI) != (j < nof_phis))
+	    throw Parse_error("invalid basic block", 0);
+	}
+    }
+  if (insts.size() != nof_insts)
+    throw Parse_error("invalid function", 0);
+
+  for (auto bb : bbs)
+    {
+      for (auto phi : bb->phis)
+	{
+	  uint32_t nof_phi_args = get_word();
+	  if (nof_phi_args == 0 || nof_phi_args != bb->preds.size())
+	    throw Parse_error("invalid phi node", 0);
+	  for (uint32_t i = 0; i < nof_phi_args; i++)
+	    {
+	      Instruction *arg_inst = get_inst();
+	      Basic_block *arg_bb = get_bb();
+	      if (!arg_inst->has_lhs()
+		  || arg_inst->bitsize != phi->bitsize
+		  || std::find(bb->preds.begin(), bb->preds.end(), arg_bb)
+		     == bb->preds.end())
+		throw Parse_error("invalid phi node", 0);
+	      for (auto& phi_arg : phi->phi_args)
+		{
+		  if (phi_arg.bb == arg_bb)
+		    throw Parse_error("invalid phi node", 0);
+		}
+	      phi->add_phi_arg(arg_inst, arg_bb);
+	    }
+	}
+      if (!bb->last_inst
+	  || (bb->last_inst->opcode != Op::BR
+	      && bb->last_inst->opcode != Op::RET))
+	throw Parse_error("basic block is not defined", 0);
+      if (bb->preds.empty() && bb != func->bbs[0])
+	throw Parse_error("basic block is not used", 0);
+    }
+
+  reverse_post_order(func);
+}
+
+Module *Reader::read_module()
+{
+  if (end - pos < 7 || memcmp(pos, magic, sizeof(magic)))
+    throw Parse_error("not a binary IR file", 0);
+  pos += 2;
+  if (get_word() != version)
+    throw Parse_error("unsupported binary IR version", 0);
+  uint32_t ptr_bits = get_word();
+  uint32_t ptr_id_bits = get_word();
+  uint32_t ptr_offset_bits = get_word();
+  if ((ptr_bits != 32 && ptr_bits != 64)
+      || ptr_bits != ptr_id_bits + ptr_offset_bits)
+    throw Parse_error("invalid config", 0);
+  uint32_t nof_functions = get_word();
+
+  Module *module = create_module(ptr_bits, ptr_id_bits, ptr_offset_bits);
+  try {
+    for (uint32_t i = 0; i < nof_functions; i++)
+      read_function(module);
+    if (pos != end)
+      throw Parse_error("trailing data", 0);
+  }
+  catch (...)
+    {
+      destroy_module(module);
+      throw;
+    }
+  return module;
+}
+
+} // end anonymous namespace
+
+bool is_binary_ir(std::string const& file_name)
+{
+  // Only regular files can be mapped, and we must not consume data from
+  // pipes as they are read by the text parser.
+  struct stat st;
+  if (stat(file_name.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+    return false;
+
+  FILE *f = fopen(file_name.c_str(), "rb");
+  if (!f)
+    return false;
+  char buf[sizeof(magic)];
+  bool is_binary = fread(buf, 1, sizeof(buf), f) == sizeof(buf)
+    && !memcmp(buf, magic, sizeof(magic));
+  fclose(f);
+  return is_binary;
+}
+
+Module *read_binary_ir(std::string const& file_name)
+{
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw Parse_error("Could not open file.", 0);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+      close(fd);
+      throw Parse_error("Could not read file.", 0);
+    }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throw Parse_error("Could not read file.", 0);
+
+  Module *module;
+  try {
+    module = read_binary_ir(data, st.st_size);
+  }
+  catch (...)
+    {
+      munmap(data, st.st_size);
+      throw;
+    }
+  munmap(data, st.st_size);
+  return module;
+}
+
+Module *read_binary_ir(const void *data, size_t size)
+{
+  Reader reader(data, size);
+  Module *module = reader.read_module();
+  validate(module);
+  return module;
+}
+
+void write_binary_ir(Module *module, FILE *stream)
+{
+  Writer writer;
+  writer.write_module(module, stream);
+}
+
+} // end namespace smtgcc
@@ -6,26 +6,49 @@
 namespace smtgcc {
 namespace {
 
-void rpo_walk(Basic_block *bb, std::vector<Basic_block *>& bbs, std::set<Basic_block *>& visited)
+// Return a bitmap, indexed by BB ID, that can hold all BBs of the function.
+std::vector<bool> bb_bitmap(Function *func)
 {
-  assert(bb->last_inst->opcode == Op::BR || bb->last_inst->opcode == Op::RET);
-  visited.insert(bb);
-  if (bb->last_inst->opcode == Op::BR)
+  int max_id = 0;
+  for (auto bb : func->bbs)
+    max_id = std::max(max_id, bb->id);
+  return std::vector<bool>(max_id + 1, false);
+}
+
+// Return the BBs reachable from the entry block in reverse post order.
+std::vector<Basic_block *> rpo_walk(Function *func)
+{
+  std::vector<bool> visited = bb_bitmap(func);
+  std::vector<Basic_block *> bbs;
+  bbs.reserve(func->bbs.size());
+
+  // The DFS stack consists of the BBs and the index of the next successor
+  // to visit.
+  std::vector<std::pair<Basic_block *, size_t>> stack;
+  stack.push_back({func->bbs[0], 0});
+  visited[func->bbs[0]->id] = true;
+  while (!stack.empty())
     {
-      if (bb->last_inst->nof_args == 0)
+      auto& [bb, succ_idx] = stack.back();
+      assert(bb->last_inst->opcode == Op::BR
+	     || bb->last_inst->opcode == Op::RET);
+      if (succ_idx < bb->succs.size())
 	{
-	  if (!visited.contains(bb->last_inst->u.br1.dest_bb))
-	    rpo_walk(bb->last_inst->u.br1.dest_bb, bbs, visited);
+	  Basic_block *succ = bb->succs[succ_idx++];
+	  if (!visited[succ->id])
+	    {
+	      visited[succ->id] = true;
+	      stack.push_back({succ, 0});
+	    }
 	}
       else
 	{
-	  if (!visited.contains(bb->last_inst->u.br3.true_bb))
-	    rpo_walk(bb->last_inst->u.br3.true_bb, bbs, visited);
-	  if (!visited.contains(bb->last_inst->u.br3.false_bb))
-	    rpo_walk(bb->last_inst->u.br3.false_bb, bbs, visited);
+	  bbs.push_back(bb);
+	  stack.pop_back();
 	}
-      bbs.insert(bbs.begin(), bb);
     }
+  std::reverse(bbs.begin(), bbs.end());
+  return bbs;
 }
 
 void remove_dead_bbs(std::vector<Basic_block *>& dead_bbs)
@@ -77,53 +100,116 @@ void remove_dead_bbs(std::vector<Basic_block *>& dead_bbs)
     }
 }
 
-// We assume the CFG is loop-free and no dead BBs.
-void calculate_dominance(Function *func)
+// Return the nearest common ancestor of a and b in the tree described by
+// parent, where each node has a smaller index than its children.
+int intersect(const std::vector<int>& parent, int a, int b)
 {
-  for (auto bb : func->bbs)
+  while (a != b)
     {
-      bb->dom.clear();
-      bb->post_dom.clear();
+      while (a > b)
+	a = parent[a];
+      while (b > a)
+	b = parent[b];
     }
+  return a;
+}
+
+// Number the nodes of the tree described by parent (rooted in node 0)
+// in DFS pre and post order, so that node a is an ancestor of node b
+// iff pre[a] <= pre[b] and post[b] <= post[a].
+void number_tree(const std::vector<int>& parent, std::vector<uint32_t>& pre,
+		 std::vector<uint32_t>& post)
+{
+  int nof_nodes = parent.size();
+  std::vector<int> first_child(nof_nodes + 1, 0);
+  for (int i = 1; i < nof_nodes; i++)
+    first_child[parent[i] + 1]++;
+  for (int i = 0; i < nof_nodes; i++)
+    first_child[i + 1] += first_child[i];
+  std::vector<int> children(nof_nodes);
+  std::vector<int> next_child(first_child.begin(), first_child.end() - 1);
+  for (int i = 1; i < nof_nodes; i++)
+    children[next_child[parent[i]]++] = i;
 
+  pre.resize(nof_nodes);
+  post.resize(nof_nodes);
+  uint32_t pre_nbr = 0;
+  uint32_t post_nbr = 0;
+  std::vector<int> stack;
+  stack.push_back(0);
+  pre[0] = pre_nbr++;
+  next_child.assign(first_child.begin(), first_child.end() - 1);
+  while (!stack.empty())
+    {
+      int node = stack.back();
+      if (next_child[node] < first_child[node + 1])
+	{
+	  int child = children[next_child[node]++];
+	  pre[child] = pre_nbr++;
+	  stack.push_back(child);
+	}
+      else
+	{
+	  post[node] = post_nbr++;
+	  stack.pop_back();
+	}
+    }
+}
+
+// Calculate the dominator and post dominator trees. The immediate
+// dominators are found by intersecting the dominator tree paths of the
+// predecessors (Cooper, Harvey, and Kennedy, "A Simple, Fast Dominance
+// Algorithm"). We assume the CFG is loop-free, has no dead BBs, and that
+// the BBs are in reverse post order, so one pass is enough.
+void calculate_dominance(Function *func)
+{
   int nof_bbs = func->bbs.size();
+  Bb_map<int> rpo_nbr;
+  rpo_nbr.reserve(nof_bbs);
+  for (int i = 0; i < nof_bbs; i++)
+    rpo_nbr[func->bbs[i]] = i;
 
   // Dominators
-  func->bbs[0]->dom.insert(func->bbs[0]);
+  std::vector<int> idom(nof_bbs, 0);
   for (int i = 1; i < nof_bbs; i++)
     {
       Basic_block *bb = func->bbs[i];
+      int dom = rpo_nbr.at(bb->preds.at(0));
+      for (size_t j = 1; j < bb->preds.size(); j++)
+	dom = intersect(idom, dom, rpo_nbr.at(bb->preds[j]));
+      idom[i] = dom;
+    }
 
-      std::set<Basic_block*> intersection = bb->preds.at(0)->dom;
-      for(size_t j = 1; j < bb->preds.size(); j++) {
-        std::set<Basic_block*> temp;
-	std::set<Basic_block*>& pred_dom = bb->preds.at(j)->dom;
-        std::set_intersection(intersection.begin(), intersection.end(),
-                              pred_dom.begin(), pred_dom.end(),
-                              std::inserter(temp, temp.begin()));
-        intersection = std::move(temp);
-      }
-      bb->dom = std::move(intersection);
-      bb->dom.insert(bb);
+  // Post dominators. These are calculated in the same way as the
+  // dominators, but on the reversed CFG, where node i corresponds to
+  // func->bbs[nof_bbs - 1 - i].
+  std::vector<int> ipost_dom(nof_bbs, 0);
+  for (int i = 1; i < nof_bbs; i++)
+    {
+      Basic_block *bb = func->bbs[nof_bbs - 1 - i];
+      int dom = nof_bbs - 1 - rpo_nbr.at(bb->succs.at(0));
+      for (size_t j = 1; j < bb->succs.size(); j++)
+	dom = intersect(ipost_dom, dom, nof_bbs - 1 - rpo_nbr.at(bb->succs[j]));
+      ipost_dom[i] = dom;
     }
 
-  // Post dominators
-  func->bbs[nof_bbs - 1]->dom.insert(func->bbs[nof_bbs - 1]);
-  for (int i = nof_bbs - 2; i >= 0; i--)
+  std::vector<uint32_t> pre;
+  std::vector<uint32_t> post;
+  number_tree(idom, pre, post);
+  for (int i = 0; i < nof_bbs; i++)
     {
       Basic_block *bb = func->bbs[i];
-
-      std::set<Basic_block*> intersection = bb->succs.at(0)->post_dom;
-      for(size_t j = 1; j < bb->succs.size(); j++) {
-        std::set<Basic_block*> temp;
-	std::set<Basic_block*>& succ_post_dom = bb->succs.at(j)->post_dom;
-        std::set_intersection(intersection.begin(), intersection.end(),
-                              succ_post_dom.begin(), succ_post_dom.end(),
-                              std::inserter(temp, temp.begin()));
-        intersection = std::move(temp);
-      }
-      bb->post_dom = std::move(intersection);
-      bb->post_dom.insert(bb);
+      bb->idom = i > 0 ? func->bbs[idom[i]] : nullptr;
+      bb->dom_pre = pre[i];
+      bb->dom_post = post[i];
+    }
+  number_tree(ipost_dom, pre, post);
+  for (int i = 0; i < nof_bbs; i++)
+    {
+      Basic_block *bb = func->bbs[nof_bbs - 1 - i];
+      bb->ipost_dom = i > 0 ? func->bbs[nof_bbs - 1 - ipost_dom[i]] : nullptr;
+      bb->post_dom_pre = pre[i];
+      bb->post_dom_post = post[i];
     }
 }
 
@@ -138,37 +224,34 @@ void update_phi(Basic_block *dest_bb, Basic_block *orig_src_bb, Basic_block *new
 
 } // end anonymous namespace
 
-Basic_block *nearest_dominator(const Basic_block *bb_in)
+Basic_block *nearest_dominator(const Basic_block *bb)
 {
-  if (bb_in->preds.size() == 0)
-    return nullptr;
-
-  Basic_block *bb = bb_in->preds.at(0);
-  for (;;)
-    {
-      unsigned count = 0;
-      for (auto pred : bb_in->preds)
-	{
-	  count += dominates(bb, pred);
-	}
-      if (count == bb_in->preds.size())
-	return bb;
-      if (!(bb->preds.size() > 0))
-	abort();
-      bb = bb->preds.at(0);
-    }
+  return bb->idom;
 }
 
 // Check if bb1 dominates bb2
 bool dominates(const Basic_block *bb1, const Basic_block *bb2)
 {
-  return bb2->dom.contains(const_cast<Basic_block *>(bb1));
+  return bb1->dom_pre <= bb2->dom_pre && bb2->dom_post <= bb1->dom_post;
 }
 
 // Check if bb1 post dominates bb2
 bool post_dominates(const Basic_block *bb1, const Basic_block *bb2)
 {
-  return bb2->post_dom.contains(const_cast<Basic_block *>(bb1));
+  return (bb1->post_dom_pre <= bb2->post_dom_pre
+	  && bb2->post_dom_post <= bb1->post_dom_post);
+}
+
+// Return the BBs reachable from the entry block in reverse post order.
+// The result is cached in the function until the CFG is modified.
+const std::vector<Basic_block *>& rpo_bbs(Function *func)
+{
+  if (!func->rpo_cache_valid)
+    {
+      func->rpo_cache = rpo_walk(func);
+      func->rpo_cache_valid = true;
+    }
+  return func->rpo_cache;
 }
 
 void reverse_post_order(Function *func)
@@ -180,18 +263,23 @@ void reverse_post_order(Function *func)
   assert(it != func->bbs.end());
   Basic_block *exit_bb = *it;
 
-  std::vector<Basic_block *> bbs;
-  std::set<Basic_block *> visited;
-  rpo_walk(func->bbs[0], bbs, visited);
-  bbs.push_back(exit_bb);
-  if (!visited.contains(exit_bb))
+  // The exit block must be placed last, even if the function has loops
+  // that makes it finish early in the DFS.
+  std::vector<Basic_block *> bbs = rpo_bbs(func);
+  auto exit_it = std::find(bbs.begin(), bbs.end(), exit_bb);
+  if (exit_it == bbs.end())
     throw Not_implemented("unreachable exit BB (infinite loop)");
+  bbs.erase(exit_it);
+  bbs.push_back(exit_bb);
   if (bbs.size() != func->bbs.size())
     {
+      std::vector<bool> visited = bb_bitmap(func);
+      for (auto bb : bbs)
+	visited[bb->id] = true;
       std::vector<Basic_block *> dead_bbs;
       for (auto bb : func->bbs)
 	{
-	  if (!visited.contains(bb))
+	  if (!visited[bb->id])
 	    dead_bbs.push_back(bb);
 	}
       remove_dead_bbs(dead_bbs);
@@ -200,17 +288,25 @@ void reverse_post_order(Function *func)
 
   if (!has_loops(func))
     calculate_dominance(func);
+  else
+    {
+      for (auto bb : func->bbs)
+	{
+	  bb->idom = nullptr;
+	  bb->ipost_dom = nullptr;
+	}
+    }
 }
 
 bool has_loops(Function *func)
 {
-  std::set<Basic_block*> visited;
-  for (auto bb : func->bbs)
+  std::vector<bool> visited = bb_bitmap(func);
+  for (auto bb : rpo_bbs(func))
     {
-      visited.insert(bb);
+      visited[bb->id] = true;
       for (auto succ : bb->succs)
 	{
-	  if (visited.contains(succ))
+	  if (visited[succ->id])
 	    return true;
 	}
     }
@@ -250,7 +346,7 @@ void simplify_cfg(Function *func)
 	  && bb->phis.size() == 0)
 	{
 	  Basic_block *dest_bb = bb->first_inst->u.br1.dest_bb;
-	  std::vector<Basic_block *> preds = bb->preds;
+	  std::vector<Basic_block *> preds(bb->preds.begin(), bb->preds.end());
 	  for (auto pred : preds)
 	    {
 	      assert(pred->last_inst->opcode == Op::BR);
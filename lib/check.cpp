@@ -10,9 +10,16 @@
 //  * Running CSE. This helps the SMT solver, as many GCC optimizations
 //    only makes minor changes to the IR, so most of the code is identical
 //    for src and tgt.
+//  * Resolving memory reads at constant addresses to the stored values.
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #include "smtgcc.h"
 
@@ -65,6 +72,27 @@ enum class Function_role {
   src, tgt
 };
 
+// The parts of the refinement check, in priority order. Each part is
+// solved on its own slice of the check function.
+enum Slice_kind {
+  retval_slice,
+  memory_slice,
+  ub_slice,
+  nof_slices
+};
+
+const char *slice_names[nof_slices] = {"retval", "memory", "ub"};
+
+// Maximum number of slices the global memory objects are split into
+// for the memory check.
+const size_t max_memory_slices = 8;
+
+// Maximum number of slices that are solved in parallel. Each slice may
+// use several threads (e.g., two solvers in portfolio mode), and the
+// solvers share the memory limit, so solving all slices at the same
+// time would oversubscribe the machine.
+const size_t max_parallel_slices = 4;
+
 struct Inst_comp {
   bool operator()(const Instruction *a, const Instruction *b) const {
     return a->id < b->id;
@@ -77,30 +105,39 @@ struct Inst_comp {
 // arrays.
 class Converter {
   // Maps basic blocks to an expression telling if it is executed.
-  std::map<Basic_block *, Instruction *> bb2cond;
+  Bb_map<Instruction *> bb2cond;
 
   // Maps basic blocks to the expressions determining if it contain UB.
-  std::map<Basic_block *, std::vector<Instruction *>> bb2ub;
+  Bb_map<std::vector<Instruction *>> bb2ub;
 
   // Maps basic blocks to an expression determining if it contain an
   // assertion failure.
-  std::map<Basic_block *, Instruction *> bb2not_assert;
+  Bb_map<Instruction *> bb2not_assert;
 
   // Maps basic blocks to the memory state at the end of the basic block.
-  std::map<Basic_block *, Instruction *> bb2memory;
-  std::map<Basic_block *, Instruction *> bb2memory_size;
-  std::map<Basic_block *, Instruction *> bb2memory_flag;
-  std::map<Basic_block *, Instruction *> bb2memory_undef;
+  Bb_map<Instruction *> bb2memory;
+  Bb_map<Instruction *> bb2memory_size;
+  Bb_map<Instruction *> bb2memory_flag;
+  Bb_map<Instruction *> bb2memory_undef;
 
   // List of the mem_id for the constant memory blocks.
   std::vector<Instruction *> const_ids;
 
+  // The ids of the global memory objects in src and tgt.
+  std::vector<uint64_t> global_ids;
+
   // Table for mapping original instructions to the corresponding new
   // instruction in destination function.
-  std::map<Instruction*, Instruction*> translate;
+  Inst_map<Instruction *> translate;
 
   std::map<Cse_key, Instruction*> key2inst;
 
+  // Cache for array_read.
+  std::map<Cse_key, Instruction*> key2read;
+
+  // Cache for global_memory_undef.
+  std::map<Instruction *, Instruction *> global_undef;
+
   std::map<Instruction *, std::vector<Instruction *>, Inst_comp> src_bbcond2ub;
   std::map<Instruction *, std::vector<Instruction *>, Inst_comp> tgt_bbcond2ub;
   bool has_tgt = false;
@@ -135,15 +172,20 @@ class Converter {
   Instruction *bool_or(Instruction *a, Instruction *b);
   Instruction *bool_and(Instruction *a, Instruction *b);
   Instruction *bool_not(Instruction *a);
+  Instruction *array_read(Op opcode, Instruction *array, Instruction *idx);
+  Instruction *global_memory_undef(Instruction *array);
   void add_ub(Basic_block *bb, Instruction *cond);
   void add_assert(Basic_block *bb, Instruction *cond);
   std::map<Instruction *, std::vector<Instruction *>, Inst_comp> prepare_ub(Function *func);
   void generate_ub();
   Instruction *generate_assert(Function *func);
   Instruction *get_full_edge_cond(Basic_block *src, Basic_block *dest);
-  void build_mem_state(Basic_block *bb, std::map<Basic_block*, Instruction*>& map);
+  void build_mem_state(Basic_block *bb, Bb_map<Instruction *>& map);
   void generate_bb2cond(Basic_block *bb);
   void convert(Basic_block *bb, Instruction *inst, Function_role role);
+  void read_markers();
+
+  Function *slice(Slice_kind kind);
 
   Instruction *get_inst(const Cse_key& key, bool may_add_insts = true);
   Instruction *value_inst(unsigned __int128 value, uint32_t bitsize);
@@ -163,7 +205,10 @@ public:
 
   void convert_function(Function *func, Function_role role);
   void finalize();
+  void sweep();
+  bool need_checking(Slice_kind kind);
   bool need_checking();
+  std::vector<std::pair<Slice_kind, Function *>> slices();
 
   Module *module = nullptr;
   Function *dest_func = nullptr;
@@ -397,6 +442,107 @@ Instruction *Converter::bool_not(Instruction *a)
   return build_inst(Op::NOT, a);
 }
 
+// Read index idx of array, where opcode is ARRAY_LOAD, ARRAY_GET_UNDEF,
+// etc. Reads of constant indices are resolved through the writes to other
+// constant indices (and through ITE of arrays), so memory that is only
+// accessed at constant addresses becomes plain bit-vector values that
+// the solver can handle without reasoning about the arrays.
+Instruction *Converter::array_read(Op opcode, Instruction *array,
+				   Instruction *idx)
+{
+  Op write_op;
+  switch (opcode)
+    {
+    case Op::ARRAY_LOAD:
+      write_op = Op::ARRAY_STORE;
+      break;
+    case Op::ARRAY_GET_UNDEF:
+      write_op = Op::ARRAY_SET_UNDEF;
+      break;
+    case Op::ARRAY_GET_FLAG:
+      write_op = Op::ARRAY_SET_FLAG;
+      break;
+    case Op::ARRAY_GET_SIZE:
+      write_op = Op::ARRAY_SET_SIZE;
+      break;
+    default:
+      throw Not_implemented("array_read: "s + inst_info[(int)opcode].name);
+    }
+
+  const Cse_key key(opcode, array, idx);
+  auto I = key2read.find(key);
+  if (I != key2read.end())
+    return I->second;
+
+  Instruction *res = nullptr;
+  while (!res)
+    {
+      if (array->opcode == write_op && array->arguments[1] == idx)
+	res = array->arguments[2];
+      else if (array->opcode == write_op
+	       && array->arguments[1]->opcode == Op::VALUE
+	       && idx->opcode == Op::VALUE)
+	{
+	  // Compare the values instead of relying on the constants being
+	  // unique.
+	  if (array->arguments[1]->value() == idx->value())
+	    res = array->arguments[2];
+	  else
+	    array = array->arguments[0];
+	}
+      else if (array->opcode == Op::ITE && idx->opcode == Op::VALUE)
+	{
+	  Instruction *read1 = array_read(opcode, array->arguments[1], idx);
+	  Instruction *read2 = array_read(opcode, array->arguments[2], idx);
+	  res = ite(array->arguments[0], read1, read2);
+	}
+      else
+	res = build_inst(opcode, array, idx);
+    }
+  key2read.insert({key, res});
+  return res;
+}
+
+// Return the undef array with the writes to constant local addresses
+// removed. Only global memory is checked, so the local writes do not
+// matter for the SRC_MEM2 and TGT_MEM2 markers, and removing them makes
+// it possible to simplify the undef array to MEM_UNDEF_ARRAY when no
+// undefined value is written to global memory.
+Instruction *Converter::global_memory_undef(Instruction *array)
+{
+  auto I = global_undef.find(array);
+  if (I != global_undef.end())
+    return I->second;
+
+  std::vector<Instruction *> writes;
+  Instruction *res = array;
+  while (res->opcode == Op::ARRAY_SET_UNDEF)
+    {
+      writes.push_back(res);
+      res = res->arguments[0];
+    }
+  if (res->opcode == Op::ITE)
+    {
+      Instruction *array1 = global_memory_undef(res->arguments[1]);
+      Instruction *array2 = global_memory_undef(res->arguments[2]);
+      res = ite(res->arguments[0], array1, array2);
+    }
+  for (auto it = writes.rbegin(); it != writes.rend(); it++)
+    {
+      Instruction *ptr = (*it)->arguments[1];
+      if (ptr->opcode == Op::VALUE)
+	{
+	  uint64_t id = (ptr->value() >> module->ptr_id_low)
+	    & (((uint64_t)1 << module->ptr_id_bits) - 1);
+	  if ((id >> (module->ptr_id_bits - 1)) != 0)
+	    continue;
+	}
+      res = build_inst(Op::ARRAY_SET_UNDEF, res, ptr, (*it)->arguments[2]);
+    }
+  global_undef.insert({array, res});
+  return res;
+}
+
 void Converter::add_ub(Basic_block *bb, Instruction *cond)
 {
   bb2ub[bb].push_back(cond);
@@ -410,7 +556,7 @@ void Converter::add_assert(Basic_block *bb, Instruction *cond)
       cond = bool_or(bb2not_assert.at(bb), cond);
       bb2not_assert.erase(bb);
     }
-  bb2not_assert.insert({bb, cond});
+  bb2not_assert.insert(bb, cond);
 }
 
 std::map<Instruction *, std::vector<Instruction *>, Inst_comp> Converter::prepare_ub(Function *func)
@@ -582,7 +728,7 @@ Instruction *Converter::get_full_edge_cond(Basic_block *src, Basic_block *dest)
   return bool_and(bb2cond.at(src), cond);
 }
 
-void Converter::build_mem_state(Basic_block *bb, std::map<Basic_block*, Instruction*>& map)
+void Converter::build_mem_state(Basic_block *bb, Bb_map<Instruction *>& map)
 {
   assert(bb->preds.size() > 0);
   Instruction *inst = map.at(bb->preds[0]);
@@ -591,7 +737,7 @@ void Converter::build_mem_state(Basic_block *bb, std::map<Basic_block*, Instruct
       Basic_block *pred_bb = bb->preds[i];
       inst = ite(bb2cond.at(pred_bb), map.at(pred_bb), inst);
     }
-  map.insert({bb, inst});
+  map.insert(bb, inst);
 }
 
 void Converter::generate_bb2cond(Basic_block *bb)
@@ -601,7 +747,7 @@ void Converter::generate_bb2cond(Basic_block *bb)
     {
       // If the dominator is post dominated by bb, then they have identical
       // conditions.
-      bb2cond.insert({bb, bb2cond.at(dominator)});
+      bb2cond.insert(bb, bb2cond.at(dominator));
     }
   else
     {
@@ -611,7 +757,7 @@ void Converter::generate_bb2cond(Basic_block *bb)
 	{
 	  cond = bool_or(cond, get_full_edge_cond(pred_bb, bb));
 	}
-      bb2cond.insert({bb, cond});
+      bb2cond.insert(bb, cond);
     }
 }
 
@@ -626,7 +772,7 @@ void Converter::convert(Basic_block *bb, Instruction *inst, Function_role role)
     {
       Instruction *array = bb2memory.at(bb);
       Instruction *ptr = translate.at(inst->arguments[0]);
-      new_inst = build_inst(Op::ARRAY_LOAD, array, ptr);
+      new_inst = array_read(Op::ARRAY_LOAD, array, ptr);
     }
   else if (inst->opcode == Op::STORE)
     {
@@ -678,19 +824,19 @@ void Converter::convert(Basic_block *bb, Instruction *inst, Function_role role)
      {
       Instruction *array = bb2memory_undef.at(bb);
       Instruction *arg1 = translate.at(inst->arguments[0]);
-      new_inst = build_inst(Op::ARRAY_GET_UNDEF, array, arg1);
+      new_inst = array_read(Op::ARRAY_GET_UNDEF, array, arg1);
      }
    else if (inst->opcode == Op::GET_MEM_FLAG)
      {
       Instruction *array = bb2memory_flag.at(bb);
       Instruction *arg1 = translate.at(inst->arguments[0]);
-      new_inst = build_inst(Op::ARRAY_GET_FLAG, array, arg1);
+      new_inst = array_read(Op::ARRAY_GET_FLAG, array, arg1);
      }
    else if (inst->opcode == Op::GET_MEM_SIZE)
     {
       Instruction *array = bb2memory_size.at(bb);
       Instruction *arg1 = translate.at(inst->arguments[0]);
-      new_inst = build_inst(Op::ARRAY_GET_SIZE, array, arg1);
+      new_inst = array_read(Op::ARRAY_GET_SIZE, array, arg1);
     }
   else if (inst->opcode == Op::IS_CONST_MEM)
     {
@@ -723,6 +869,12 @@ void Converter::convert(Basic_block *bb, Instruction *inst, Function_role role)
       if (flags & MEM_CONST)
 	const_ids.push_back(translate.at(inst->arguments[0]));
 
+      if (id != 0
+	  && (id >> (ptr_id_bits - 1)) == 0
+	  && std::find(global_ids.begin(), global_ids.end(), id)
+	     == global_ids.end())
+	global_ids.push_back(id);
+
       if (flags & MEM_UNINIT)
 	{
 	  Instruction *undef_array = bb2memory_undef.at(bb);
@@ -828,7 +980,7 @@ void Converter::convert(Basic_block *bb, Instruction *inst, Function_role role)
 	}
     }
   assert(new_inst);
-  translate.insert({inst, new_inst});
+  translate.insert(inst, new_inst);
 }
 
 void Converter::convert_function(Function *func, Function_role role)
@@ -839,11 +991,11 @@ void Converter::convert_function(Function *func, Function_role role)
     {
       if (bb == func->bbs[0])
 	{
-	  bb2cond.insert({bb, value_inst(1, 1)});
-	  bb2memory.insert({bb, memory});
-	  bb2memory_size.insert({bb, memory_size});
-	  bb2memory_flag.insert({bb, memory_flag});
-	  bb2memory_undef.insert({bb, memory_undef});
+	  bb2cond.insert(bb, value_inst(1, 1));
+	  bb2memory.insert(bb, memory);
+	  bb2memory_size.insert(bb, memory_size);
+	  bb2memory_flag.insert(bb, memory_flag);
+	  bb2memory_undef.insert(bb, memory_undef);
 	}
       else
 	{
@@ -865,7 +1017,7 @@ void Converter::convert_function(Function *func, Function_role role)
 	      Instruction *inst = translate.at(phi->phi_args[i].inst);
 	      phi_inst = ite(cond, inst, phi_inst);
 	    }
-	  translate.insert({phi, phi_inst});
+	  translate.insert(phi, phi_inst);
 	}
 
       for (Instruction *inst = bb->first_inst; inst; inst = inst->next)
@@ -890,21 +1042,22 @@ void Converter::convert_function(Function *func, Function_role role)
   Op mem2_op = role == Function_role::src ? Op::SRC_MEM2 : Op::TGT_MEM2;
   build_inst(mem1_op, bb2memory.at(exit_block),
 		      bb2memory_size.at(exit_block));
-  build_inst(mem2_op, bb2memory_flag.at(exit_block),
-		      bb2memory_undef.at(exit_block));
+  Instruction *memory_undef =
+    global_memory_undef(bb2memory_undef.at(exit_block));
+  build_inst(mem2_op, bb2memory_flag.at(exit_block), memory_undef);
   if (role == Function_role::src)
     {
       src_memory = bb2memory.at(exit_block);
       src_memory_flag = bb2memory_flag.at(exit_block);
       src_memory_size = bb2memory_size.at(exit_block);
-      src_memory_undef = bb2memory_undef.at(exit_block);
+      src_memory_undef = memory_undef;
     }
   else
     {
       tgt_memory = bb2memory.at(exit_block);
       tgt_memory_flag = bb2memory_flag.at(exit_block);
       tgt_memory_size = bb2memory_size.at(exit_block);
-      tgt_memory_undef = bb2memory_undef.at(exit_block);
+      tgt_memory_undef = memory_undef;
     }
 
   // Clear the arrays. This is needed for check_refine to get a clean slate
@@ -927,38 +1080,574 @@ void Converter::finalize()
 
   build_inst(Op::RET);
 
+  // Constant fold the undef tracking. The undef values and the memory
+  // undef state become constant 0 when no undefined value can reach
+  // them, and the solvers can then skip checking them.
+  simplify_insts(dest_func);
+  key2inst.clear();
+  key2read.clear();
+  global_undef.clear();
+  read_markers();
+
   dead_code_elimination(dest_func);
   dest_func->canonicalize();
 }
 
-bool Converter::need_checking()
+// Merge equal instructions in dest_func, and update the src and tgt
+// values to the merged instructions.
+void Converter::sweep()
 {
-  if (src_retval != tgt_retval
-      || src_retval_undef != tgt_retval_undef)
-    return true;
+  if (!config.sweep || !::smtgcc::sweep(dest_func))
+    return;
+
+  read_markers();
+}
 
-  if (src_memory != tgt_memory
-      || src_memory_size != tgt_memory_size
-      || src_memory_undef != tgt_memory_undef)
-    return true;
+// Update the src_retval, etc. from the marker instructions in dest_func
+// after dest_func has been modified.
+void Converter::read_markers()
+{
+  for (Instruction *inst = dest_func->bbs[0]->first_inst;
+       inst;
+       inst = inst->next)
+    {
+      switch (inst->opcode)
+	{
+	case Op::SRC_RETVAL:
+	  src_retval = inst->arguments[0];
+	  src_retval_undef = inst->arguments[1];
+	  break;
+	case Op::TGT_RETVAL:
+	  tgt_retval = inst->arguments[0];
+	  tgt_retval_undef = inst->arguments[1];
+	  break;
+	case Op::SRC_MEM1:
+	  src_memory = inst->arguments[0];
+	  src_memory_size = inst->arguments[1];
+	  break;
+	case Op::TGT_MEM1:
+	  tgt_memory = inst->arguments[0];
+	  tgt_memory_size = inst->arguments[1];
+	  break;
+	case Op::SRC_MEM2:
+	  src_memory_flag = inst->arguments[0];
+	  src_memory_undef = inst->arguments[1];
+	  break;
+	case Op::TGT_MEM2:
+	  tgt_memory_flag = inst->arguments[0];
+	  tgt_memory_undef = inst->arguments[1];
+	  break;
+	case Op::SRC_UB:
+	  src_common_ub = inst->arguments[0];
+	  src_unique_ub = inst->arguments[1];
+	  break;
+	case Op::TGT_UB:
+	  tgt_common_ub = inst->arguments[0];
+	  tgt_unique_ub = inst->arguments[1];
+	  break;
+	default:
+	  break;
+	}
+    }
+}
 
-  assert(src_common_ub == tgt_common_ub);
-  if (src_unique_ub != tgt_unique_ub
-      && !(tgt_unique_ub->opcode == Op::VALUE
-	   && tgt_unique_ub->value() == 0))
-    return true;
+bool Converter::need_checking(Slice_kind kind)
+{
+  switch (kind)
+    {
+    case retval_slice:
+      return src_retval != tgt_retval || src_retval_undef != tgt_retval_undef;
+    case memory_slice:
+      return src_memory != tgt_memory
+	|| src_memory_size != tgt_memory_size
+	|| src_memory_undef != tgt_memory_undef;
+    case ub_slice:
+      assert(src_common_ub == tgt_common_ub);
+      return src_unique_ub != tgt_unique_ub
+	&& !(tgt_unique_ub->opcode == Op::VALUE
+	     && tgt_unique_ub->value() == 0);
+    default:
+      throw Not_implemented("need_checking: unknown slice kind");
+    }
+}
 
+bool Converter::need_checking()
+{
+  for (int i = 0; i < nof_slices; i++)
+    {
+      if (need_checking((Slice_kind)i))
+	return true;
+    }
   return false;
 }
 
+// Limit the memory check of the slice func to the objects in ids.
+void limit_memory_check(Function *func, const std::vector<uint64_t>& ids)
+{
+  Instruction *ret = func->bbs[0]->last_inst;
+  for (uint64_t id : ids)
+    {
+      Instruction *id_inst = func->value_inst(id, func->module->ptr_id_bits);
+      create_inst(Op::CHECK_MEM_ID, id_inst)->insert_before(ret);
+    }
+  func->canonicalize();
+}
+
+// Exclude the objects in ids from the memory check of the slice func, by
+// setting their size to 0 in the src memory size.
+void exclude_from_memory_check(Function *func,
+			       const std::vector<uint64_t>& ids)
+{
+  Instruction *mem1 = func->bbs[0]->first_inst;
+  while (mem1->opcode != Op::SRC_MEM1)
+    mem1 = mem1->next;
+
+  Instruction *size = mem1->arguments[1];
+  Instruction *zero = func->value_inst(0, func->module->ptr_offset_bits);
+  for (uint64_t id : ids)
+    {
+      Instruction *id_inst = func->value_inst(id, func->module->ptr_id_bits);
+      size = create_inst(Op::ARRAY_SET_SIZE, size, id_inst, zero);
+      size->insert_before(mem1);
+    }
+  create_inst(Op::SRC_MEM1, mem1->arguments[0], size)->insert_before(mem1);
+  destroy_instruction(mem1);
+  func->canonicalize();
+}
+
+// Return a copy of dest_func, in a new module, that only contains what is
+// needed for checking kind. The src UB is kept in all slices, as the
+// checks assume there is no UB in src. The UB check is removed from the
+// other slices by letting tgt have the same UB as src.
+Function *Converter::slice(Slice_kind kind)
+{
+  Module *slice_module =
+    create_module(module->ptr_bits, module->ptr_id_bits,
+		  module->ptr_offset_bits);
+  Function *func = dest_func->clone(slice_module);
+
+  Instruction *src_ub = nullptr;
+  Instruction *tgt_ub = nullptr;
+  std::vector<Instruction *> removed;
+  for (Instruction *inst = func->bbs[0]->first_inst; inst; inst = inst->next)
+    {
+      switch (inst->opcode)
+	{
+	case Op::SRC_RETVAL:
+	case Op::TGT_RETVAL:
+	  if (kind != retval_slice)
+	    removed.push_back(inst);
+	  break;
+	case Op::SRC_MEM1:
+	case Op::SRC_MEM2:
+	case Op::TGT_MEM1:
+	case Op::TGT_MEM2:
+	  if (kind != memory_slice)
+	    removed.push_back(inst);
+	  break;
+	case Op::SRC_ASSERT:
+	case Op::TGT_ASSERT:
+	  removed.push_back(inst);
+	  break;
+	case Op::SRC_UB:
+	  src_ub = inst;
+	  break;
+	case Op::TGT_UB:
+	  tgt_ub = inst;
+	  break;
+	default:
+	  break;
+	}
+    }
+  if (kind != ub_slice)
+    {
+      Instruction *new_tgt_ub =
+	create_inst(Op::TGT_UB, src_ub->arguments[0], src_ub->arguments[1]);
+      new_tgt_ub->insert_before(tgt_ub);
+      removed.push_back(tgt_ub);
+    }
+  for (Instruction *inst : removed)
+    destroy_instruction(inst);
+
+  dead_code_elimination(func);
+  func->canonicalize();
+  return func;
+}
+
+// Return the slices of dest_func for the parts of the check that are
+// needed. The memory check is split into one slice per group of global
+// memory objects, and one slice for the memory not in any of the
+// objects, as the solver is much faster when the id of the checked
+// memory is known.
+std::vector<std::pair<Slice_kind, Function *>> Converter::slices()
+{
+  std::vector<std::pair<Slice_kind, Function *>> result;
+  for (int i = 0; i < nof_slices; i++)
+    {
+      Slice_kind kind = (Slice_kind)i;
+      if (!need_checking(kind))
+	continue;
+      if (kind != memory_slice || global_ids.size() < 2)
+	{
+	  result.push_back({kind, slice(kind)});
+	  continue;
+	}
+
+      std::vector<uint64_t> ids = global_ids;
+      std::sort(ids.begin(), ids.end());
+      size_t nof_groups = std::min(ids.size(), max_memory_slices);
+      for (size_t group = 0; group < nof_groups; group++)
+	{
+	  std::vector<uint64_t> group_ids;
+	  for (size_t j = group; j < ids.size(); j += nof_groups)
+	    group_ids.push_back(ids[j]);
+	  Function *func = slice(kind);
+	  limit_memory_check(func, group_ids);
+	  result.push_back({kind, func});
+	}
+      Function *func = slice(kind);
+      exclude_from_memory_check(func, ids);
+      result.push_back({kind, func});
+    }
+  return result;
+}
+
+// Run one solver on func, in a worker process if config.workers > 0.
+//
+// cvc5 cannot be interrupted while it is solving, so it is also run in a
+// worker process when it may be interrupted (the worker is then killed),
+// as the thread waiting for it would otherwise block until cvc5 times out.
+std::pair<SStats, Solver_result> solve_with(Function *func, Check_kind kind,
+					    Solver_mode solver,
+					    Solver_stats& stats,
+					    Solver_interrupt *interrupt)
+{
+  if (config.workers > 0 || (solver == Solver_mode::cvc5 && interrupt))
+    return check_in_worker(func, kind, solver, stats, interrupt);
+  return run_solver(func, kind, solver, stats, interrupt);
+}
+
+// Run z3 and cvc5 in parallel, and return the result from the solver
+// that first finds a conclusive answer. The other solver is interrupted.
+std::pair<SStats, Solver_result> run_portfolio(Function *func,
+					       Check_kind kind,
+					       Solver_stats& stats,
+					       Solver_interrupt *interrupt)
+{
+  const char *names[2] = {"z3", "cvc5"};
+  Solver_mode solvers[2] = {Solver_mode::z3, Solver_mode::cvc5};
+  Solver_interrupt interrupts[2];
+  Solver_stats solver_stats[2];
+  std::pair<SStats, Solver_result> results[2];
+  std::exception_ptr exceptions[2];
+  std::mutex mutex;
+  int winner = -1;
+
+  Solver_interrupt::Scope scope(interrupt, [&interrupts]() {
+    interrupts[0].interrupt();
+    interrupts[1].interrupt();
+  });
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; i++)
+    {
+      threads.emplace_back([&, i]() {
+	try
+	  {
+	    results[i] = solve_with(func, kind, solvers[i], solver_stats[i],
+				    &interrupts[i]);
+	    if (results[i].second.status != Result_status::unknown)
+	      {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (winner < 0)
+		  {
+		    winner = i;
+		    interrupts[1 - i].interrupt();
+		  }
+	      }
+	  }
+	catch (...)
+	  {
+	    exceptions[i] = std::current_exception();
+	  }
+      });
+    }
+  // Both solvers stop promptly when interrupted, so the loser does not
+  // delay the result.
+  for (auto& thread : threads)
+    thread.join();
+
+  stats.z3 = solver_stats[0].z3;
+  stats.cvc5 = solver_stats[1].cvc5;
+  if (winner >= 0)
+    {
+      if (config.verbose > 0)
+	fprintf(stderr, "SMTGCC: portfolio winner: %s\n", names[winner]);
+      return results[winner];
+    }
+
+  // Neither solver found a conclusive answer. A solver that failed (e.g.,
+  // because it does not support some operation) is ignored as long as
+  // the other solver succeeded.
+  for (int i = 0; i < 2; i++)
+    {
+      if (!exceptions[i])
+	return results[i];
+    }
+  std::rethrow_exception(exceptions[0]);
+}
+
+void print_stats(const Solver_stats& stats)
+{
+  if (!stats.cvc5.skipped || !stats.z3.skipped)
+    {
+      fprintf(stderr, "SMTGCC: time: ");
+      for (int i = 0; i < 3; i++)
+	{
+	  fprintf(stderr, "%s%" PRIu64, i ? "," : "", stats.cvc5.time[i]);
+	}
+      for (int i = 0; i < 3; i++)
+	{
+	  fprintf(stderr, "%s%" PRIu64, ",", stats.z3.time[i]);
+	}
+      fprintf(stderr, "\n");
+    }
+}
+
+// Check func using the solver(s) selected by config.solver. The queries
+// are first dumped (if enabled), labelled by the name of the slice.
+std::pair<SStats, Solver_result> solve(Function *func, Check_kind kind,
+				       const Check_origin& origin,
+				       const std::string& slice,
+				       Solver_stats& stats,
+				       Solver_interrupt *interrupt = nullptr)
+{
+  dump_queries(func, kind, origin, slice);
+
+  if (config.solver == Solver_mode::portfolio)
+    return run_portfolio(func, kind, stats, interrupt);
+  return solve_with(func, kind, config.solver, stats, interrupt);
+}
+
+// Solve the parts of the refinement check in parallel (at most
+// max_parallel_slices at a time), each on its own slice of the check
+// function. The result of the highest priority part
+// that finds the transformation incorrect is returned. When a slice finds
+// it incorrect, the slices with lower priority are interrupted, as are
+// the other slices of the same part, so the first counterexample found
+// for the part is reported.
+std::pair<SStats, Solver_result> solve_slices(Converter& converter,
+					      const Check_origin& origin,
+					      Solver_stats& stats)
+{
+  std::vector<std::pair<Slice_kind, Function *>> slices = converter.slices();
+  size_t nof_funcs = slices.size();
+
+  // The slices are named by their kind and their index within the kind,
+  // e.g., "memory 2".
+  std::vector<std::string> names(nof_funcs);
+  std::array<int, nof_slices> nof_kind_slices;
+  nof_kind_slices.fill(0);
+  for (size_t i = 0; i < nof_funcs; i++)
+    {
+      Slice_kind kind = slices[i].first;
+      names[i] = slice_names[kind] + " "s
+	+ std::to_string(nof_kind_slices[kind]++);
+    }
+
+  std::vector<std::pair<SStats, Solver_result>> results(nof_funcs);
+  std::vector<Solver_stats> slice_stats(nof_funcs);
+  std::vector<std::exception_ptr> exceptions(nof_funcs);
+  std::vector<Solver_interrupt> interrupts(nof_funcs);
+  std::mutex mutex;
+  std::array<int, nof_slices> first_incorrect;
+  first_incorrect.fill(-1);
+  std::atomic<size_t> next_slice = 0;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < std::min(nof_funcs, max_parallel_slices); t++)
+    {
+      threads.emplace_back([&]() {
+	// The slices are in priority order, so the high priority parts
+	// are started first.
+	for (size_t i = next_slice++; i < nof_funcs; i = next_slice++)
+	  {
+	    auto [kind, func] = slices[i];
+	    if (interrupts[i].is_interrupted())
+	      {
+		results[i].second = {Result_status::unknown,
+				     "Analysis interrupted\n"};
+		continue;
+	      }
+	    try
+	      {
+		results[i] = solve(func, Check_kind::refine, origin, names[i],
+				   slice_stats[i], &interrupts[i]);
+		if (results[i].second.status == Result_status::incorrect)
+		  {
+		    std::lock_guard<std::mutex> lock(mutex);
+		    if (first_incorrect[kind] < 0)
+		      {
+			first_incorrect[kind] = i;
+			for (size_t j = 0; j < nof_funcs; j++)
+			  {
+			    if (j != i && slices[j].first >= kind)
+			      interrupts[j].interrupt();
+			  }
+		      }
+		  }
+	      }
+	    catch (...)
+	      {
+		exceptions[i] = std::current_exception();
+	      }
+	  }
+      });
+    }
+  for (auto& thread : threads)
+    thread.join();
+  for (auto [kind, func] : slices)
+    destroy_module(func->module);
+
+  // A slice that is interrupted may fail, but its result is not used.
+  for (size_t i = 0; i < nof_funcs; i++)
+    {
+      if (exceptions[i] && !interrupts[i].is_interrupted())
+	std::rethrow_exception(exceptions[i]);
+    }
+
+  // The slices of a part run in parallel, so the time for the part is
+  // the time of its slowest slice.
+  SStats solver_stats;
+  for (size_t i = 0; i < nof_funcs; i++)
+    {
+      int kind = slices[i].first;
+      auto merge = [kind](SStats& dest, const SStats& src) {
+	dest.time[kind] = std::max(dest.time[kind], src.time[kind]);
+	dest.skipped &= src.skipped;
+      };
+      merge(solver_stats, results[i].first);
+      merge(stats.z3, slice_stats[i].z3);
+      merge(stats.cvc5, slice_stats[i].cvc5);
+    }
+
+  for (int kind = 0; kind < nof_slices; kind++)
+    {
+      if (first_incorrect[kind] >= 0)
+	{
+	  // The lower priority parts are not part of the result.
+	  for (int j = kind + 1; j < nof_slices; j++)
+	    solver_stats.time[j] = 0;
+	  return {solver_stats, results[first_incorrect[kind]].second};
+	}
+    }
+
+  std::string warning;
+  for (size_t i = 0; i < nof_funcs; i++)
+    {
+      Solver_result& result = results[i].second;
+      if (result.status == Result_status::unknown)
+	{
+	  // Avoid repeating the message for each memory slice.
+	  assert(result.message);
+	  if (warning.find(*result.message) == std::string::npos)
+	    warning = warning + *result.message;
+	}
+    }
+  if (!warning.empty())
+    return {solver_stats, {Result_status::unknown, warning}};
+  return {solver_stats, {Result_status::correct, {}}};
+}
+
 } // end anonymous namespace
 
-Solver_result check_refine(Module *module)
+std::pair<SStats, Solver_result> run_solver(Function *func, Check_kind kind,
+					    Solver_mode solver,
+					    Solver_stats& stats,
+					    Solver_interrupt *interrupt)
+{
+  using Check_fn =
+    std::pair<SStats, Solver_result> (*)(Function *, Solver_interrupt *);
+  Check_fn check_z3;
+  Check_fn check_cvc5;
+  switch (kind)
+    {
+    case Check_kind::refine:
+      check_z3 = check_refine_z3;
+      check_cvc5 = check_refine_cvc5;
+      break;
+    case Check_kind::ub:
+      check_z3 = check_ub_z3;
+      check_cvc5 = check_ub_cvc5;
+      break;
+    case Check_kind::assertion:
+      check_z3 = check_assert_z3;
+      check_cvc5 = check_assert_cvc5;
+      break;
+    default:
+      throw Not_implemented("run_solver: unknown check kind");
+    }
+
+  switch (solver)
+    {
+    case Solver_mode::z3:
+      {
+	auto [stats_z3, result_z3] = check_z3(func, interrupt);
+	stats.z3 = stats_z3;
+	return {stats_z3, result_z3};
+      }
+    case Solver_mode::cvc5:
+      {
+	auto [stats_cvc5, result_cvc5] = check_cvc5(func, interrupt);
+	stats.cvc5 = stats_cvc5;
+	return {stats_cvc5, result_cvc5};
+      }
+    default:
+      break;
+    }
+
+  throw Not_implemented("run_solver: unknown solver");
+}
+
+// Return the largest id and size of the memory objects in the memory
+// size array size_array, or std::nullopt if they are not constants.
+std::optional<std::pair<uint64_t, uint64_t>>
+max_memory_object(Instruction *size_array)
+{
+  uint64_t max_id = 0;
+  uint64_t max_size = 0;
+  std::set<Instruction *> visited;
+  std::vector<Instruction *> worklist = {size_array};
+  while (!worklist.empty())
+    {
+      Instruction *array = worklist.back();
+      worklist.pop_back();
+      if (!visited.insert(array).second)
+	continue;
+      if (array->opcode == Op::ARRAY_SET_SIZE)
+	{
+	  Instruction *id = array->arguments[1];
+	  Instruction *size = array->arguments[2];
+	  worklist.push_back(array->arguments[0]);
+	  if (size->opcode == Op::VALUE && size->value() == 0)
+	    continue;
+	  if (id->opcode != Op::VALUE || size->opcode != Op::VALUE)
+	    return {};
+	  max_id = std::max(max_id, (uint64_t)id->value());
+	  max_size = std::max(max_size, (uint64_t)size->value());
+	}
+      else if (array->opcode == Op::ITE)
+	{
+	  worklist.push_back(array->arguments[1]);
+	  worklist.push_back(array->arguments[2]);
+	}
+      else if (array->opcode != Op::MEM_SIZE_ARRAY)
+	return {};
+    }
+  return std::pair(max_id, max_size);
+}
+
+Solver_result check_refine(Module *module, const Check_origin& origin)
 {
-  struct VStats {
-    SStats cvc5;
-    SStats z3;
-  } stats;
+  Solver_stats stats;
 
   assert(module->functions.size() == 2);
   Function *src = module->functions[0];
@@ -981,46 +1670,54 @@ Solver_result check_refine(Module *module)
       converter.module->print(stderr);
     }
 
-  Solver_result result = {Result_status::correct, {}};
-#if 0
-  auto [stats_cvc5, result_cvc5] = check_refine_cvc5(converter.dest_func);
-  stats.cvc5 = stats_cvc5;
-  if (result_cvc5.status != Result_status::correct)
-    result = result_cvc5;
-#endif
-#if 1
-  auto [stats_z3, result_z3] = check_refine_z3(converter.dest_func);
-  stats.z3 = stats_z3;
-  if (result_z3.status != Result_status::correct)
-    result = result_z3;
-#endif
-
-  if (config.verbose > 0)
+  // The cache key and the falsifier use the function before it is swept,
+  // as sweeping is much slower than both.
+  Solver_result result;
+  unsigned __int128 cache_key = converter.dest_func->structural_hash();
+  if (auto cached = cache_lookup(cache_key))
     {
-      if (!stats.cvc5.skipped || !stats.z3.skipped)
-	{
-	  fprintf(stderr, "SMTGCC: time: ");
-	  for (int i = 0; i < 3; i++)
-	    {
-	      fprintf(stderr, "%s%" PRIu64, i ? "," : "", stats.cvc5.time[i]);
-	    }
-	  for (int i = 0; i < 3; i++)
-	    {
-	      fprintf(stderr, "%s%" PRIu64, ",", stats.z3.time[i]);
-	    }
-	  fprintf(stderr, "\n");
-	}
+      if (config.verbose > 0)
+	fprintf(stderr, "SMTGCC: Using cached result\n");
+      stats = cached->first;
+      result = cached->second;
+    }
+  else if (auto falsified = falsify(converter.dest_func, Check_kind::refine))
+    {
+      if (config.verbose > 0)
+	fprintf(stderr, "SMTGCC: Counterexample found by evaluation\n");
+      result = *falsified;
+    }
+  else
+    {
+      // Sweeping runs z3 in this process, so it is not done when the
+      // solvers run in worker processes.
+      if (config.workers <= 0)
+	converter.sweep();
+
+      // The incremental solving shares the work between the parts of
+      // the check, so it solves the full check function.
+      if (!converter.need_checking())
+	result = {};
+      else if (config.incremental)
+	result =
+	  solve(converter.dest_func, Check_kind::refine, origin, "", stats)
+	  .second;
+      else
+	result = solve_slices(converter, origin, stats).second;
+      // The statistics for each solver are cached, so a cache hit
+      // reports the times for the solvers that produced the result.
+      cache_insert(cache_key, stats, result);
     }
 
+  if (config.verbose > 0)
+    print_stats(stats);
+
   return result;
 }
 
-Solver_result check_ub(Function *func)
+Solver_result check_ub(Function *func, const Check_origin& origin)
 {
-  struct VStats {
-    SStats cvc5;
-    SStats z3;
-  } stats;
+  Solver_stats stats;
 
   Converter converter(func->module);
   converter.convert_function(func, Function_role::src);
@@ -1032,46 +1729,26 @@ Solver_result check_ub(Function *func)
       converter.module->print(stderr);
     }
 
-  Solver_result result = {Result_status::correct, {}};
-#if 0
-  auto [stats_cvc5, result_cvc5] = check_ub_cvc5(converter.dest_func);
-  stats.cvc5 = stats_cvc5;
-  if (result_cvc5.status != Result_status::correct)
-    result = result_cvc5;
-#endif
-#if 1
-  auto [stats_z3, result_z3] = check_ub_z3(converter.dest_func);
-  stats.z3 = stats_z3;
-  if (result_z3.status != Result_status::correct)
-    result = result_z3;
-#endif
-
-  if (config.verbose > 0)
+  Solver_result result;
+  if (auto falsified = falsify(converter.dest_func, Check_kind::ub))
     {
-      if (!stats.cvc5.skipped || !stats.z3.skipped)
-	{
-	  fprintf(stderr, "SMTGCC: time: ");
-	  for (int i = 0; i < 3; i++)
-	    {
-	      fprintf(stderr, "%s%" PRIu64, i ? "," : "", stats.cvc5.time[i]);
-	    }
-	  for (int i = 0; i < 3; i++)
-	    {
-	      fprintf(stderr, "%s%" PRIu64, ",", stats.z3.time[i]);
-	    }
-	  fprintf(stderr, "\n");
-	}
+      if (config.verbose > 0)
+	fprintf(stderr, "SMTGCC: Counterexample found by evaluation\n");
+      result = *falsified;
     }
+  else
+    result =
+      solve(converter.dest_func, Check_kind::ub, origin, "", stats).second;
+
+  if (config.verbose > 0)
+    print_stats(stats);
 
   return result;
 }
 
-Solver_result check_assert(Function *func)
+Solver_result check_assert(Function *func, const Check_origin& origin)
 {
-  struct VStats {
-    SStats cvc5;
-    SStats z3;
-  } stats;
+  Solver_stats stats;
 
   Converter converter(func->module);
   converter.convert_function(func, Function_role::src);
@@ -1083,36 +1760,19 @@ Solver_result check_assert(Function *func)
       converter.module->print(stderr);
     }
 
-  Solver_result result = {Result_status::correct, {}};
-#if 0
-  auto [stats_cvc5, result_cvc5] = check_assert_cvc5(converter.dest_func);
-  stats.cvc5 = stats_cvc5;
-  if (result_cvc5.status != Result_status::correct)
-    result = result_cvc5;
-#endif
-#if 1
-  auto [stats_z3, result_z3] = check_assert_z3(converter.dest_func);
-  stats.z3 = stats_z3;
-  if (result_z3.status != Result_status::correct)
-    result = result_z3;
-#endif
-
-  if (config.verbose > 0)
+  Solver_result result;
+  if (auto falsified = falsify(converter.dest_func, Check_kind::assertion))
     {
-      if (!stats.cvc5.skipped || !stats.z3.skipped)
-	{
-	  fprintf(stderr, "SMTGCC: time: ");
-	  for (int i = 0; i < 3; i++)
-	    {
-	      fprintf(stderr, "%s%" PRIu64, i ? "," : "", stats.cvc5.time[i]);
-	    }
-	  for (int i = 0; i < 3; i++)
-	    {
-	      fprintf(stderr, "%s%" PRIu64, ",", stats.z3.time[i]);
-	    }
-	  fprintf(stderr, "\n");
-	}
+      if (config.verbose > 0)
+	fprintf(stderr, "SMTGCC: Counterexample found by evaluation\n");
+      result = *falsified;
     }
+  else
+    result = solve(converter.dest_func, Check_kind::assertion, origin, "",
+		   stats).second;
+
+  if (config.verbose > 0)
+    print_stats(stats);
 
   return result;
 }
@@ -0,0 +1,1241 @@
+// Search for counterexamples by evaluating the check function on concrete
+// inputs before running the SMT solver.
+//
+// Most incorrect transformations fail for many inputs, so evaluating the
+// function produced by the Converter for a few hundred random and
+// boundary values of the parameters usually finds a counterexample much
+// faster than the solver. The solver is still needed for proving that
+// the transformation is correct.
+//
+// A counterexample must be a valid model for the SMT query, so the
+// evaluation must never depend on values the solver is free to choose
+// differently. An input is therefore discarded when the result depends
+// on the bit pattern of a NaN, or on the result of an out-of-range
+// floating-point to integer conversion.
+//
+// The inputs are evaluated in batches of batch_size inputs. The values
+// of an instruction for all inputs in the batch are stored consecutively,
+// so each instruction is evaluated by a loop over the inputs that the
+// compiler can vectorize. Values of at most 64 bits are stored as
+// uint64_t, and wider values as unsigned __int128.
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <deque>
+#include <type_traits>
+
+#include "smtgcc.h"
+
+using namespace std::string_literals;
+
+namespace smtgcc {
+
+namespace {
+
+// Values used for the parameters in the first inputs, and for some of the
+// parameters in the random inputs.
+const int nof_boundary_values = 6;
+
+// The number of inputs evaluated together. Each input in the batch
+// corresponds to one bit of Falsifier::valid.
+const int batch_size = 64;
+
+template<typename T = unsigned __int128>
+T mask(uint32_t bitsize)
+{
+  if (bitsize >= sizeof(T) * 8)
+    return ~(T)0;
+  return ((T)1 << bitsize) - 1;
+}
+
+template<typename T>
+using Signed =
+  std::conditional_t<std::is_same_v<T, uint64_t>, int64_t, __int128>;
+
+template<typename T>
+Signed<T> sign_extend(T value, uint32_t bitsize)
+{
+  uint32_t shift = sizeof(T) * 8 - bitsize;
+  return (Signed<T>)(value << shift) >> shift;
+}
+
+template<typename T>
+bool is_negative(T value, uint32_t bitsize)
+{
+  return (value >> (bitsize - 1)) & 1;
+}
+
+// The splitmix64 mixing function.
+uint64_t mix(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+uint64_t hash_address(uint64_t seed, unsigned __int128 address)
+{
+  return mix(seed ^ mix((uint64_t)address ^ mix(address >> 64)));
+}
+
+// Format the value the same way as z3 does in its models.
+std::string bv_to_string(unsigned __int128 value, uint32_t bitsize)
+{
+  std::string str;
+  if (bitsize % 4 == 0)
+    {
+      str = "#x";
+      for (int i = bitsize - 4; i >= 0; i -= 4)
+	str += "0123456789abcdef"[(value >> i) & 0xf];
+    }
+  else
+    {
+      str = "#b";
+      for (int i = bitsize - 1; i >= 0; i--)
+	str += ((value >> i) & 1) ? '1' : '0';
+    }
+  return str;
+}
+
+bool is_supported_fp(uint32_t bitsize)
+{
+  return bitsize == 32 || bitsize == 64;
+}
+
+bool is_nan(unsigned __int128 value, uint32_t bitsize)
+{
+  if (bitsize == 32)
+    return __builtin_isnan(std::bit_cast<float>((uint32_t)value));
+  assert(bitsize == 64);
+  return __builtin_isnan(std::bit_cast<double>((uint64_t)value));
+}
+
+double to_double(unsigned __int128 value, uint32_t bitsize)
+{
+  if (bitsize == 32)
+    return std::bit_cast<float>((uint32_t)value);
+  assert(bitsize == 64);
+  return std::bit_cast<double>((uint64_t)value);
+}
+
+// Convert the result of a floating-point operation to its bit pattern.
+// The bit pattern of a NaN is not specified, so the input is discarded.
+unsigned __int128 from_double(double value, uint32_t bitsize,
+			      bool& inconclusive)
+{
+  if (__builtin_isnan(value))
+    {
+      inconclusive = true;
+      return 0;
+    }
+  if (bitsize == 32)
+    return std::bit_cast<uint32_t>((float)value);
+  assert(bitsize == 64);
+  return std::bit_cast<uint64_t>(value);
+}
+
+// Evaluate the floating-point instruction inst for one input. inconclusive
+// is set if the result depends on a choice made by the SMT solver.
+unsigned __int128 eval_fp(Instruction *inst, unsigned __int128 a,
+			  unsigned __int128 b, bool& inconclusive)
+{
+  uint32_t bitsize = inst->bitsize;
+  uint32_t arg_bitsize = inst->arguments[0]->bitsize;
+  switch (inst->opcode)
+    {
+    case Op::IS_NAN:
+      return is_nan(a, arg_bitsize);
+    case Op::IS_NONCANONICAL_NAN:
+      // The canonical NaN is not specified in the SMT-LIB floating-point
+      // theory.
+      inconclusive = is_nan(a, arg_bitsize);
+      return 0;
+    case Op::F2S:
+    case Op::F2U:
+      {
+	// The result is unspecified for NaN, Inf, and values that are
+	// out of range.
+	double f = to_double(a, arg_bitsize);
+	double t = __builtin_trunc(f);
+	double limit = __builtin_ldexp(1.0, bitsize);
+	if (inst->opcode == Op::F2S)
+	  limit = __builtin_ldexp(1.0, bitsize - 1);
+	double low = inst->opcode == Op::F2S ? -limit : 0;
+	if (!__builtin_isfinite(f) || t < low || t >= limit)
+	  {
+	    inconclusive = true;
+	    return 0;
+	  }
+	if (inst->opcode == Op::F2U)
+	  return (unsigned __int128)t;
+	return (unsigned __int128)(__int128)t & mask(bitsize);
+      }
+    case Op::S2F:
+      {
+	__int128 s = sign_extend(a, arg_bitsize);
+	if (bitsize == 32)
+	  return std::bit_cast<uint32_t>((float)s);
+	return std::bit_cast<uint64_t>((double)s);
+      }
+    case Op::U2F:
+      if (bitsize == 32)
+	return std::bit_cast<uint32_t>((float)a);
+      return std::bit_cast<uint64_t>((double)a);
+    case Op::FCHPREC:
+      return from_double(to_double(a, arg_bitsize), bitsize, inconclusive);
+    default:
+      break;
+    }
+
+  double x = to_double(a, arg_bitsize);
+  switch (inst->opcode)
+    {
+    case Op::FABS:
+      return from_double(__builtin_fabs(x), bitsize, inconclusive);
+    case Op::FNEG:
+      return from_double(-x, bitsize, inconclusive);
+    default:
+      break;
+    }
+
+  double y = to_double(b, arg_bitsize);
+  double res;
+  switch (inst->opcode)
+    {
+    case Op::FADD:
+      res = bitsize == 32 ? (float)x + (float)y : x + y;
+      break;
+    case Op::FSUB:
+      res = bitsize == 32 ? (float)x - (float)y : x - y;
+      break;
+    case Op::FMUL:
+      res = bitsize == 32 ? (float)x * (float)y : x * y;
+      break;
+    case Op::FDIV:
+      res = bitsize == 32 ? (float)x / (float)y : x / y;
+      break;
+    case Op::FEQ:
+      return x == y;
+    case Op::FNE:
+      return !(x == y);
+    case Op::FGE:
+      return x >= y;
+    case Op::FGT:
+      return x > y;
+    case Op::FLE:
+      return x <= y;
+    case Op::FLT:
+      return x < y;
+    default:
+      throw Not_implemented("eval_fp: "s + inst->name());
+    }
+  return from_double(res, bitsize, inconclusive);
+}
+
+// An array is a chain of stores on top of one of the initial arrays.
+// Reads of addresses that have not been stored get the value from the
+// initial array.
+struct Array_node {
+  const Array_node *prev;
+  unsigned __int128 index;
+  unsigned __int128 value;
+
+  // The kind of the initial array (MEM_ARRAY, etc.) for the first node
+  // in the chain.
+  Op base;
+};
+
+// Read the value at index. The addresses read from the initial .memory
+// array are added to initial_reads, as they are part of the counterexample.
+unsigned __int128 load(const Array_node *node, unsigned __int128 index,
+		       uint64_t memory_seed,
+		       std::vector<unsigned __int128>& initial_reads)
+{
+  for (; node->prev; node = node->prev)
+    {
+      if (node->index == index)
+	return node->value;
+    }
+
+  // The .memory array is unconstrained, so we may choose its content.
+  // The other arrays are initialized to 0.
+  if (node->base == Op::MEM_ARRAY)
+    {
+      initial_reads.push_back(index);
+      return hash_address(memory_seed, index) & 0xff;
+    }
+  return 0;
+}
+
+// Where the values of an instruction are stored. The values for the
+// inputs in the batch are at index * batch_size in the array for the kind.
+struct Slot {
+  enum class Kind : uint8_t {narrow, wide, array};
+
+  Kind kind;
+  uint32_t index;
+};
+
+class Falsifier {
+  Function *func;
+  Check_kind kind;
+
+  // The instructions are evaluated in the order of the function, which
+  // is the order from Function::canonicalize. The instructions having the
+  // same value for all inputs (such as VALUE, which canonicalize places
+  // first) are in constants, and are evaluated only once.
+  std::vector<Instruction *> constants;
+  std::vector<Instruction *> insts;
+  std::vector<Instruction *> inputs;
+
+  Inst_map<Slot> slots;
+  uint32_t nof_slots[3] = {0, 0, 0};
+  std::vector<uint64_t> narrow_values;
+  std::vector<unsigned __int128> wide_values;
+  std::vector<const Array_node *> array_values;
+
+  // The initial arrays are shared by all batches, while the nodes for the
+  // stores are freed after each batch.
+  std::deque<Array_node> base_nodes;
+  std::deque<Array_node> nodes;
+  uint64_t memory_seeds[batch_size];
+  std::vector<unsigned __int128> initial_reads[batch_size];
+
+  // Bit i is set if input i in the batch may be a counterexample, and is
+  // cleared when the evaluation depends on a choice made by the solver.
+  uint64_t valid;
+
+  // The inputs are pseudo-random with a fixed seed, so the result is
+  // the same for each run.
+  uint64_t rng_state = 0;
+  uint64_t rng()
+  {
+    return mix(rng_state++);
+  }
+
+  Instruction *src_assert = nullptr;
+  Instruction *src_memory = nullptr;
+  Instruction *src_memory_size = nullptr;
+  Instruction *src_memory_undef = nullptr;
+  Instruction *src_retval = nullptr;
+  Instruction *src_retval_undef = nullptr;
+  Instruction *src_unique_ub = nullptr;
+  Instruction *src_common_ub = nullptr;
+  Instruction *tgt_memory = nullptr;
+  Instruction *tgt_memory_undef = nullptr;
+  Instruction *tgt_retval = nullptr;
+  Instruction *tgt_retval_undef = nullptr;
+  Instruction *tgt_unique_ub = nullptr;
+  std::vector<unsigned __int128> mem_ids;
+
+  void add_slot(Instruction *inst);
+  uint64_t *narrow(Instruction *inst)
+  {
+    return &narrow_values[slots.at(inst).index * batch_size];
+  }
+  unsigned __int128 *wide(Instruction *inst)
+  {
+    return &wide_values[slots.at(inst).index * batch_size];
+  }
+  const Array_node **array(Instruction *inst)
+  {
+    return &array_values[slots.at(inst).index * batch_size];
+  }
+  bool is_narrow(Instruction *inst)
+  {
+    return slots.at(inst).kind == Slot::Kind::narrow;
+  }
+  unsigned __int128 value(Instruction *inst, int i)
+  {
+    if (is_narrow(inst))
+      return narrow(inst)[i];
+    return wide(inst)[i];
+  }
+  void set_value(Instruction *inst, int i, unsigned __int128 value)
+  {
+    if (is_narrow(inst))
+      narrow(inst)[i] = value;
+    else
+      wide(inst)[i] = value;
+  }
+
+  unsigned __int128 boundary_value(uint32_t bitsize, int nr);
+  void generate_input(int input_nr, int i);
+  void eval_constants();
+  void eval(Instruction *inst);
+  void eval_array(Instruction *inst);
+  void eval_bv(Instruction *inst);
+  template<typename T>
+  void eval_bv(Instruction *inst, T *res, const T *const *args);
+  std::string model(int i);
+  std::optional<Solver_result> check_retval(int i);
+  std::optional<Solver_result> check_memory(int i);
+  std::optional<Solver_result> check_input(int i, int& priority);
+  void eval_batch(int first);
+
+public:
+  Falsifier(Function *func, Check_kind kind);
+  bool is_supported();
+  std::optional<Solver_result> run(int nof_inputs);
+  Inst_map<uint64_t> simulate(int nof_inputs);
+};
+
+Falsifier::Falsifier(Function *func, Check_kind kind)
+  : func{func}
+  , kind{kind}
+{
+  assert(func->bbs.size() == 1);
+  for (Instruction *inst = func->bbs[0]->first_inst; inst; inst = inst->next)
+    {
+      switch (inst->opcode)
+	{
+	case Op::VALUE:
+	case Op::MEM_ARRAY:
+	case Op::MEM_FLAG_ARRAY:
+	case Op::MEM_SIZE_ARRAY:
+	case Op::MEM_UNDEF_ARRAY:
+	  constants.push_back(inst);
+	  add_slot(inst);
+	  break;
+	case Op::PARAM:
+	case Op::SYMBOLIC:
+	  inputs.push_back(inst);
+	  add_slot(inst);
+	  break;
+	case Op::CHECK_MEM_ID:
+	  mem_ids.push_back(inst->arguments[0]->value());
+	  break;
+	case Op::SRC_ASSERT:
+	  src_assert = inst->arguments[0];
+	  break;
+	case Op::SRC_MEM1:
+	  src_memory = inst->arguments[0];
+	  src_memory_size = inst->arguments[1];
+	  break;
+	case Op::SRC_MEM2:
+	  src_memory_undef = inst->arguments[1];
+	  break;
+	case Op::TGT_MEM1:
+	  tgt_memory = inst->arguments[0];
+	  break;
+	case Op::TGT_MEM2:
+	  tgt_memory_undef = inst->arguments[1];
+	  break;
+	case Op::SRC_RETVAL:
+	  src_retval = inst->arguments[0];
+	  src_retval_undef = inst->arguments[1];
+	  break;
+	case Op::TGT_RETVAL:
+	  tgt_retval = inst->arguments[0];
+	  tgt_retval_undef = inst->arguments[1];
+	  break;
+	case Op::SRC_UB:
+	  src_common_ub = inst->arguments[0];
+	  src_unique_ub = inst->arguments[1];
+	  break;
+	case Op::TGT_UB:
+	  tgt_unique_ub = inst->arguments[1];
+	  break;
+	case Op::RET:
+	case Op::TGT_ASSERT:
+	  break;
+	default:
+	  insts.push_back(inst);
+	  add_slot(inst);
+	  break;
+	}
+    }
+}
+
+void Falsifier::add_slot(Instruction *inst)
+{
+  Slot::Kind slot_kind;
+  switch (inst->opcode)
+    {
+    case Op::MEM_ARRAY:
+    case Op::MEM_FLAG_ARRAY:
+    case Op::MEM_SIZE_ARRAY:
+    case Op::MEM_UNDEF_ARRAY:
+    case Op::ARRAY_SET_FLAG:
+    case Op::ARRAY_SET_SIZE:
+    case Op::ARRAY_SET_UNDEF:
+    case Op::ARRAY_STORE:
+      slot_kind = Slot::Kind::array;
+      break;
+    case Op::ITE:
+      slot_kind = slots.at(inst->arguments[1]).kind;
+      break;
+    default:
+      slot_kind = inst->bitsize <= 64 ? Slot::Kind::narrow : Slot::Kind::wide;
+      break;
+    }
+  slots[inst] = {slot_kind, nof_slots[(int)slot_kind]++};
+}
+
+// Check that all instructions can be evaluated.
+bool Falsifier::is_supported()
+{
+  for (Instruction *inst : insts)
+    {
+      if (inst->bitsize > 128)
+	return false;
+      for (uint16_t i = 0; i < inst->nof_args; i++)
+	{
+	  if (inst->arguments[i]->bitsize > 128)
+	    return false;
+	}
+
+      switch (inst->opcode)
+	{
+	case Op::FEQ:
+	case Op::FGE:
+	case Op::FGT:
+	case Op::FLE:
+	case Op::FLT:
+	case Op::FNE:
+	case Op::IS_NAN:
+	case Op::IS_NONCANONICAL_NAN:
+	case Op::F2S:
+	case Op::F2U:
+	  if (!is_supported_fp(inst->arguments[0]->bitsize))
+	    return false;
+	  break;
+	case Op::FABS:
+	case Op::FNEG:
+	case Op::FADD:
+	case Op::FDIV:
+	case Op::FMUL:
+	case Op::FSUB:
+	case Op::S2F:
+	case Op::U2F:
+	  if (!is_supported_fp(inst->bitsize))
+	    return false;
+	  break;
+	case Op::FCHPREC:
+	  if (!is_supported_fp(inst->bitsize)
+	      || !is_supported_fp(inst->arguments[0]->bitsize))
+	    return false;
+	  break;
+	case Op::ASSERT:
+	case Op::BR:
+	case Op::FREE:
+	case Op::GET_MEM_FLAG:
+	case Op::GET_MEM_SIZE:
+	case Op::GET_MEM_UNDEF:
+	case Op::IS_CONST_MEM:
+	case Op::LOAD:
+	case Op::MEMORY:
+	case Op::PHI:
+	case Op::READ:
+	case Op::REGISTER:
+	case Op::SET_MEM_FLAG:
+	case Op::SET_MEM_UNDEF:
+	case Op::STORE:
+	case Op::UB:
+	case Op::WRITE:
+	  // These are eliminated by the Converter.
+	  return false;
+	default:
+	  break;
+	}
+    }
+  for (Instruction *inst : inputs)
+    {
+      if (inst->bitsize > 128)
+	return false;
+    }
+  for (Instruction *inst : constants)
+    {
+      if (inst->bitsize > 128)
+	return false;
+    }
+  return true;
+}
+
+unsigned __int128 Falsifier::boundary_value(uint32_t bitsize, int nr)
+{
+  switch (nr)
+    {
+    case 0:
+      return 0;
+    case 1:
+      return 1;
+    case 2:
+      return mask(bitsize);
+    case 3:
+      return (unsigned __int128)1 << (bitsize - 1);
+    case 4:
+      return mask(bitsize) >> 1;
+    case 5:
+      return 2 & mask(bitsize);
+    default:
+      throw Not_implemented("boundary_value: invalid value");
+    }
+}
+
+// Set the values of the parameters and the initial memory for input i
+// in the batch. The first inputs use the same boundary value for all
+// parameters, and the rest use a mix of boundary values, small values,
+// and random values.
+void Falsifier::generate_input(int input_nr, int i)
+{
+  memory_seeds[i] = rng();
+  for (Instruction *inst : inputs)
+    {
+      uint32_t bitsize = inst->bitsize;
+      unsigned __int128 value;
+      if (input_nr < nof_boundary_values)
+	value = boundary_value(bitsize, input_nr);
+      else
+	{
+	  switch (rng() % 4)
+	    {
+	    case 0:
+	      value = boundary_value(bitsize, rng() % nof_boundary_values);
+	      break;
+	    case 1:
+	      value = (int64_t)(rng() % 33) - 16;
+	      break;
+	    default:
+	      value = (unsigned __int128)rng() << 64 | rng();
+	      break;
+	    }
+	}
+      set_value(inst, i, value & mask(bitsize));
+    }
+}
+
+void Falsifier::eval_constants()
+{
+  narrow_values.resize(nof_slots[(int)Slot::Kind::narrow] * batch_size);
+  wide_values.resize(nof_slots[(int)Slot::Kind::wide] * batch_size);
+  array_values.resize(nof_slots[(int)Slot::Kind::array] * batch_size);
+
+  for (Instruction *inst : constants)
+    {
+      if (inst->opcode == Op::VALUE)
+	{
+	  for (int i = 0; i < batch_size; i++)
+	    set_value(inst, i, inst->value());
+	}
+      else
+	{
+	  base_nodes.push_back({nullptr, 0, 0, inst->opcode});
+	  std::fill_n(array(inst), batch_size, &base_nodes.back());
+	}
+    }
+}
+
+void Falsifier::eval(Instruction *inst)
+{
+  switch (inst->opcode)
+    {
+    case Op::PARAM:
+    case Op::SYMBOLIC:
+      // Set by generate_input.
+      break;
+    case Op::ARRAY_GET_FLAG:
+    case Op::ARRAY_GET_SIZE:
+    case Op::ARRAY_GET_UNDEF:
+    case Op::ARRAY_LOAD:
+    case Op::ARRAY_SET_FLAG:
+    case Op::ARRAY_SET_SIZE:
+    case Op::ARRAY_SET_UNDEF:
+    case Op::ARRAY_STORE:
+      eval_array(inst);
+      break;
+    case Op::ITE:
+      if (slots.at(inst).kind == Slot::Kind::array)
+	eval_array(inst);
+      else
+	eval_bv(inst);
+      break;
+    case Op::NAN:
+      // The bit pattern is chosen by the solver.
+      valid = 0;
+      break;
+    default:
+      eval_bv(inst);
+      break;
+    }
+}
+
+void Falsifier::eval_array(Instruction *inst)
+{
+  Instruction *arg1 = inst->arguments[0];
+  Instruction *arg2 = inst->arguments[1];
+  switch (inst->opcode)
+    {
+    case Op::ARRAY_GET_FLAG:
+    case Op::ARRAY_GET_SIZE:
+    case Op::ARRAY_GET_UNDEF:
+    case Op::ARRAY_LOAD:
+      for (int i = 0; i < batch_size; i++)
+	set_value(inst, i, load(array(arg1)[i], value(arg2, i),
+				memory_seeds[i], initial_reads[i]));
+      break;
+    case Op::ARRAY_SET_FLAG:
+    case Op::ARRAY_SET_SIZE:
+    case Op::ARRAY_SET_UNDEF:
+    case Op::ARRAY_STORE:
+      for (int i = 0; i < batch_size; i++)
+	{
+	  const Array_node *node = array(arg1)[i];
+	  nodes.push_back({node, value(arg2, i),
+			   value(inst->arguments[2], i), node->base});
+	  array(inst)[i] = &nodes.back();
+	}
+      break;
+    case Op::ITE:
+      for (int i = 0; i < batch_size; i++)
+	{
+	  Instruction *arg = value(arg1, i) ? arg2 : inst->arguments[2];
+	  array(inst)[i] = array(arg)[i];
+	}
+      break;
+    default:
+      throw Not_implemented("Falsifier::eval_array: "s + inst->name());
+    }
+}
+
+// Evaluate a bitvector or floating-point instruction. The common case,
+// where the instruction and its arguments are at most 64 bits, is
+// evaluated directly on the stored uint64_t values. Otherwise, all values
+// are converted to unsigned __int128.
+void Falsifier::eval_bv(Instruction *inst)
+{
+  bool all_narrow = is_narrow(inst);
+  for (uint16_t i = 0; i < inst->nof_args; i++)
+    all_narrow = all_narrow && is_narrow(inst->arguments[i]);
+  if (all_narrow)
+    {
+      const uint64_t *args[3] = {nullptr, nullptr, nullptr};
+      for (uint16_t i = 0; i < inst->nof_args; i++)
+	args[i] = narrow(inst->arguments[i]);
+      eval_bv(inst, narrow(inst), args);
+      return;
+    }
+
+  unsigned __int128 tmp[3][batch_size];
+  const unsigned __int128 *args[3] = {nullptr, nullptr, nullptr};
+  for (uint16_t i = 0; i < inst->nof_args; i++)
+    {
+      Instruction *arg = inst->arguments[i];
+      if (is_narrow(arg))
+	{
+	  std::copy_n(narrow(arg), batch_size, tmp[i]);
+	  args[i] = tmp[i];
+	}
+      else
+	args[i] = wide(arg);
+    }
+  if (is_narrow(inst))
+    {
+      unsigned __int128 res[batch_size];
+      eval_bv(inst, res, args);
+      std::copy_n(res, batch_size, narrow(inst));
+    }
+  else
+    eval_bv(inst, wide(inst), args);
+}
+
+template<typename T>
+void Falsifier::eval_bv(Instruction *inst, T *res, const T *const *args)
+{
+  const T *a = args[0];
+  const T *b = args[1];
+  const T *c = args[2];
+  uint32_t bitsize = inst->bitsize;
+  uint32_t arg_bitsize = inst->nof_args > 0 ? inst->arguments[0]->bitsize : 0;
+  T m = mask<T>(bitsize);
+
+  auto for_each_input = [&](auto f) {
+    for (int i = 0; i < batch_size; i++)
+      res[i] = f(i) & m;
+  };
+
+  switch (inst->opcode)
+    {
+    case Op::ITE:
+      for_each_input([&](int i) { return a[i] ? b[i] : c[i]; });
+      break;
+    case Op::EQ:
+      for_each_input([&](int i) { return a[i] == b[i]; });
+      break;
+    case Op::NE:
+      for_each_input([&](int i) { return a[i] != b[i]; });
+      break;
+    case Op::SGE:
+      for_each_input([&](int i) {
+	return sign_extend(a[i], arg_bitsize) >= sign_extend(b[i], arg_bitsize);
+      });
+      break;
+    case Op::SGT:
+      for_each_input([&](int i) {
+	return sign_extend(a[i], arg_bitsize) > sign_extend(b[i], arg_bitsize);
+      });
+      break;
+    case Op::SLE:
+      for_each_input([&](int i) {
+	return sign_extend(a[i], arg_bitsize) <= sign_extend(b[i], arg_bitsize);
+      });
+      break;
+    case Op::SLT:
+      for_each_input([&](int i) {
+	return sign_extend(a[i], arg_bitsize) < sign_extend(b[i], arg_bitsize);
+      });
+      break;
+    case Op::UGE:
+      for_each_input([&](int i) { return a[i] >= b[i]; });
+      break;
+    case Op::UGT:
+      for_each_input([&](int i) { return a[i] > b[i]; });
+      break;
+    case Op::ULE:
+      for_each_input([&](int i) { return a[i] <= b[i]; });
+      break;
+    case Op::ULT:
+      for_each_input([&](int i) { return a[i] < b[i]; });
+      break;
+    case Op::MOV:
+      for_each_input([&](int i) { return a[i]; });
+      break;
+    case Op::NEG:
+      for_each_input([&](int i) { return -a[i]; });
+      break;
+    case Op::NOT:
+      for_each_input([&](int i) { return ~a[i]; });
+      break;
+    case Op::ADD:
+      for_each_input([&](int i) { return a[i] + b[i]; });
+      break;
+    case Op::SUB:
+      for_each_input([&](int i) { return a[i] - b[i]; });
+      break;
+    case Op::MUL:
+      for_each_input([&](int i) { return a[i] * b[i]; });
+      break;
+    case Op::AND:
+      for_each_input([&](int i) { return a[i] & b[i]; });
+      break;
+    case Op::OR:
+      for_each_input([&](int i) { return a[i] | b[i]; });
+      break;
+    case Op::XOR:
+      for_each_input([&](int i) { return a[i] ^ b[i]; });
+      break;
+    case Op::SHL:
+      for_each_input([&](int i) {
+	return b[i] >= bitsize ? 0 : a[i] << (uint32_t)b[i];
+      });
+      break;
+    case Op::LSHR:
+      for_each_input([&](int i) {
+	return b[i] >= bitsize ? 0 : a[i] >> (uint32_t)b[i];
+      });
+      break;
+    case Op::ASHR:
+      for_each_input([&](int i) {
+	uint32_t shift = b[i] >= bitsize ? bitsize - 1 : (uint32_t)b[i];
+	return (T)(sign_extend(a[i], bitsize) >> shift);
+      });
+      break;
+    case Op::UDIV:
+      for_each_input([&](int i) { return b[i] == 0 ? m : a[i] / b[i]; });
+      break;
+    case Op::UREM:
+      for_each_input([&](int i) { return b[i] == 0 ? a[i] : a[i] % b[i]; });
+      break;
+    case Op::SDIV:
+    case Op::SREM:
+      // Use the SMT-LIB semantics: division by 0 gives -1 or 1 (depending
+      // on the sign of the dividend), and the remainder is the dividend.
+      for_each_input([&](int i) {
+	bool neg_a = is_negative(a[i], bitsize);
+	bool neg_b = is_negative(b[i], bitsize);
+	T abs_a = neg_a ? -a[i] & m : a[i];
+	T abs_b = neg_b ? -b[i] & m : b[i];
+	if (inst->opcode == Op::SDIV)
+	  {
+	    if (b[i] == 0)
+	      return neg_a ? (T)1 : m;
+	    T quot = abs_a / abs_b;
+	    return neg_a != neg_b ? -quot : quot;
+	  }
+	if (b[i] == 0)
+	  return a[i];
+	T rem = abs_a % abs_b;
+	return neg_a ? -rem : rem;
+      });
+      break;
+    case Op::SMAX:
+      for_each_input([&](int i) {
+	return sign_extend(a[i], bitsize) >= sign_extend(b[i], bitsize)
+	  ? a[i] : b[i];
+      });
+      break;
+    case Op::SMIN:
+      for_each_input([&](int i) {
+	return sign_extend(a[i], bitsize) < sign_extend(b[i], bitsize)
+	  ? a[i] : b[i];
+      });
+      break;
+    case Op::UMAX:
+      for_each_input([&](int i) { return a[i] >= b[i] ? a[i] : b[i]; });
+      break;
+    case Op::UMIN:
+      for_each_input([&](int i) { return a[i] < b[i] ? a[i] : b[i]; });
+      break;
+    case Op::SADD_WRAPS:
+      for_each_input([&](int i) {
+	T sum = (a[i] + b[i]) & mask<T>(arg_bitsize);
+	return is_negative(a[i], arg_bitsize) == is_negative(b[i], arg_bitsize)
+	  && is_negative(sum, arg_bitsize) != is_negative(a[i], arg_bitsize);
+      });
+      break;
+    case Op::SSUB_WRAPS:
+      for_each_input([&](int i) {
+	T diff = (a[i] - b[i]) & mask<T>(arg_bitsize);
+	return is_negative(a[i], arg_bitsize) != is_negative(b[i], arg_bitsize)
+	  && is_negative(diff, arg_bitsize) != is_negative(a[i], arg_bitsize);
+      });
+      break;
+    case Op::SMUL_WRAPS:
+      for_each_input([&](int i) {
+	Signed<T> prod;
+	bool overflow =
+	  __builtin_mul_overflow(sign_extend(a[i], arg_bitsize),
+				 sign_extend(b[i], arg_bitsize), &prod);
+	return overflow || sign_extend((T)prod, arg_bitsize) != prod;
+      });
+      break;
+    case Op::CONCAT:
+      {
+	uint32_t shift = inst->arguments[1]->bitsize;
+	for_each_input([&](int i) { return a[i] << shift | b[i]; });
+      }
+      break;
+    case Op::EXTRACT:
+      {
+	uint32_t shift = inst->arguments[2]->value();
+	for_each_input([&](int i) { return a[i] >> shift; });
+      }
+      break;
+    case Op::SEXT:
+      for_each_input([&](int i) { return (T)sign_extend(a[i], arg_bitsize); });
+      break;
+    case Op::ZEXT:
+      for_each_input([&](int i) { return a[i]; });
+      break;
+    case Op::FEQ:
+    case Op::FGE:
+    case Op::FGT:
+    case Op::FLE:
+    case Op::FLT:
+    case Op::FNE:
+    case Op::FABS:
+    case Op::FNEG:
+    case Op::FADD:
+    case Op::FDIV:
+    case Op::FMUL:
+    case Op::FSUB:
+    case Op::IS_NAN:
+    case Op::IS_NONCANONICAL_NAN:
+    case Op::F2S:
+    case Op::F2U:
+    case Op::S2F:
+    case Op::U2F:
+    case Op::FCHPREC:
+      for (int i = 0; i < batch_size; i++)
+	{
+	  bool inconclusive = false;
+	  res[i] = eval_fp(inst, a[i], b ? b[i] : 0, inconclusive);
+	  if (inconclusive)
+	    valid &= ~((uint64_t)1 << i);
+	}
+      break;
+    default:
+      throw Not_implemented("Falsifier::eval_bv: "s + inst->name());
+    }
+}
+
+// The values of the parameters, in the same format as z3 writes them,
+// followed by the bytes read from the initial memory.
+std::string Falsifier::model(int i)
+{
+  std::string msg;
+  for (Instruction *inst : inputs)
+    {
+      const char *prefix = inst->opcode == Op::PARAM ? ".param" : ".symbolic";
+      uint32_t index = inst->arguments[0]->value();
+      msg = msg + prefix + std::to_string(index) + " = "
+	+ bv_to_string(value(inst, i), inst->bitsize) + "\n";
+    }
+
+  std::vector<unsigned __int128> addresses = initial_reads[i];
+  std::sort(addresses.begin(), addresses.end());
+  addresses.erase(std::unique(addresses.begin(), addresses.end()),
+		  addresses.end());
+  uint32_t ptr_bits = func->module->ptr_bits;
+  for (unsigned __int128 ptr : addresses)
+    {
+      unsigned __int128 byte = hash_address(memory_seeds[i], ptr) & 0xff;
+      msg = msg + ".memory[" + bv_to_string(ptr, ptr_bits) + "] = "
+	+ bv_to_string(byte, 8) + "\n";
+    }
+  return msg;
+}
+
+std::optional<Solver_result> Falsifier::check_retval(int i)
+{
+  if (src_retval == tgt_retval && src_retval_undef == tgt_retval_undef)
+    return {};
+
+  uint32_t bitsize = src_retval->bitsize;
+  unsigned __int128 src_mask = ~value(src_retval_undef, i) & mask(bitsize);
+  unsigned __int128 src_value = value(src_retval, i) & src_mask;
+  unsigned __int128 tgt_value = value(tgt_retval, i) & src_mask;
+  bool is_more_undef = (value(tgt_retval_undef, i) & src_mask) != 0;
+  if (src_value == tgt_value && !is_more_undef)
+    return {};
+
+  std::string msg = "Transformation is not correct (retval)\n" + model(i);
+  msg = msg + "src retval: " + bv_to_string(src_value, bitsize) + "\n";
+  msg = msg + "tgt retval: " + bv_to_string(tgt_value, bitsize) + "\n";
+  // z3 does not report the undef values when both are 0.
+  if (!(src_retval_undef == tgt_retval_undef
+	&& src_retval_undef->opcode == Op::VALUE
+	&& src_retval_undef->value() == 0))
+    {
+      unsigned __int128 src_undef = value(src_retval_undef, i);
+      unsigned __int128 tgt_undef = value(tgt_retval_undef, i);
+      msg = msg + "src undef: " + bv_to_string(src_undef, bitsize) + "\n";
+      msg = msg + "tgt undef: " + bv_to_string(tgt_undef, bitsize) + "\n";
+    }
+  return Solver_result{Result_status::incorrect, msg};
+}
+
+std::optional<Solver_result> Falsifier::check_memory(int i)
+{
+  if (src_memory == tgt_memory
+      && src_memory_undef == tgt_memory_undef)
+    return {};
+
+  // Only the addresses written by src or tgt may differ.
+  std::vector<unsigned __int128> addresses;
+  for (Instruction *inst : {src_memory, tgt_memory,
+			    src_memory_undef, tgt_memory_undef})
+    {
+      for (const Array_node *node = array(inst)[i]; node->prev;
+	   node = node->prev)
+	addresses.push_back(node->index);
+    }
+  std::sort(addresses.begin(), addresses.end());
+  addresses.erase(std::unique(addresses.begin(), addresses.end()),
+		  addresses.end());
+
+  const Module *module = func->module;
+  uint64_t seed = memory_seeds[i];
+  std::vector<unsigned __int128>& reads = initial_reads[i];
+  for (unsigned __int128 ptr : addresses)
+    {
+      unsigned __int128 id = (ptr >> module->ptr_id_low)
+	& mask(module->ptr_id_bits);
+      unsigned __int128 offset = (ptr >> module->ptr_offset_low)
+	& mask(module->ptr_offset_bits);
+      // Only global memory is checked, i.e., the id must be positive.
+      if (id == 0
+	  || (id >> (module->ptr_id_bits - 1)) != 0
+	  || offset >= load(array(src_memory_size)[i], id, seed, reads))
+	continue;
+      if (!mem_ids.empty()
+	  && std::find(mem_ids.begin(), mem_ids.end(), id) == mem_ids.end())
+	continue;
+
+      unsigned __int128 src_byte =
+	load(array(src_memory)[i], ptr, seed, reads);
+      unsigned __int128 tgt_byte =
+	load(array(tgt_memory)[i], ptr, seed, reads);
+      unsigned __int128 src_undef =
+	load(array(src_memory_undef)[i], ptr, seed, reads);
+      unsigned __int128 tgt_undef =
+	load(array(tgt_memory_undef)[i], ptr, seed, reads);
+      unsigned __int128 src_mask = ~src_undef & 0xff;
+      if ((src_byte & src_mask) == (tgt_byte & src_mask)
+	  && (tgt_undef & src_mask) == 0)
+	continue;
+
+      std::string msg = "Transformation is not correct (Memory)\n" + model(i);
+      msg = msg + "\n.ptr = " + bv_to_string(ptr, module->ptr_bits) + "\n";
+      msg = msg + "src *.ptr: " + bv_to_string(src_byte, 8) + "\n";
+      msg = msg + "tgt *.ptr: " + bv_to_string(tgt_byte, 8) + "\n";
+      msg = msg + "src undef: " + bv_to_string(src_undef, 8) + "\n";
+      msg = msg + "tgt undef: " + bv_to_string(tgt_undef, 8) + "\n";
+      return Solver_result{Result_status::incorrect, msg};
+    }
+  return {};
+}
+
+// Check if input i in the batch is a counterexample for the query. The
+// refinement queries have the same priority order as in check_refine_z3,
+// and priority is set to the index of the query that failed.
+std::optional<Solver_result> Falsifier::check_input(int i, int& priority)
+{
+  bool src_ub = value(src_common_ub, i) || value(src_unique_ub, i);
+  priority = 0;
+  switch (kind)
+    {
+    case Check_kind::refine:
+      if (src_ub)
+	return {};
+      if (src_retval && tgt_retval)
+	{
+	  if (auto result = check_retval(i))
+	    return result;
+	}
+      priority = 1;
+      if (auto result = check_memory(i))
+	return result;
+      priority = 2;
+      if (value(tgt_unique_ub, i))
+	{
+	  std::string msg = "Transformation is not correct (UB)\n" + model(i);
+	  return Solver_result{Result_status::incorrect, msg};
+	}
+      return {};
+    case Check_kind::ub:
+      if (!src_ub)
+	return {};
+      return Solver_result{Result_status::incorrect,
+			   "Transformation is not correct (UB)\n" + model(i)};
+    case Check_kind::assertion:
+      if (src_ub || !value(src_assert, i))
+	return {};
+      return Solver_result{Result_status::incorrect,
+			   "Transformation is not correct (ASSERT)\n"
+			   + model(i)};
+    }
+  throw Not_implemented("Falsifier::check_input: unknown check kind");
+}
+
+// Evaluate the batch of inputs starting with input number first.
+void Falsifier::eval_batch(int first)
+{
+  nodes.clear();
+  for (int i = 0; i < batch_size; i++)
+    {
+      initial_reads[i].clear();
+      generate_input(first + i, i);
+    }
+  valid = ~(uint64_t)0;
+
+  for (Instruction *inst : insts)
+    eval(inst);
+}
+
+// Evaluate the inputs, and return the counterexample for the highest
+// priority query that fails.
+std::optional<Solver_result> Falsifier::run(int nof_inputs)
+{
+  eval_constants();
+
+  std::optional<Solver_result> best_result;
+  int best_priority = 0;
+  for (int first = 0; first < nof_inputs; first += batch_size)
+    {
+      // The last batch is evaluated for all inputs in the batch, but only
+      // the first nof_inputs inputs are checked.
+      int n = std::min(batch_size, nof_inputs - first);
+      eval_batch(first);
+
+      for (int i = 0; i < n; i++)
+	{
+	  if (!((valid >> i) & 1))
+	    continue;
+	  int priority;
+	  std::optional<Solver_result> result = check_input(i, priority);
+	  if (result && (!best_result || priority < best_priority))
+	    {
+	      best_result = result;
+	      best_priority = priority;
+	      if (priority == 0)
+		return best_result;
+	    }
+	}
+    }
+  return best_result;
+}
+
+// Evaluate the inputs, and return a hash of the values of each instruction
+// that is not an array. Instructions having the same value for all
+// inputs get the same hash.
+Inst_map<uint64_t> Falsifier::simulate(int nof_inputs)
+{
+  eval_constants();
+
+  std::vector<Instruction *> value_insts;
+  for (Instruction *inst = func->bbs[0]->first_inst; inst; inst = inst->next)
+    {
+      if (slots.contains(inst) && slots.at(inst).kind != Slot::Kind::array)
+	value_insts.push_back(inst);
+    }
+
+  std::vector<uint64_t> hashes(value_insts.size(), 0);
+  for (int first = 0; first < nof_inputs; first += batch_size)
+    {
+      eval_batch(first);
+      for (size_t j = 0; j < value_insts.size(); j++)
+	{
+	  Instruction *inst = value_insts[j];
+	  uint64_t hash = hashes[j];
+	  if (is_narrow(inst))
+	    {
+	      const uint64_t *values = narrow(inst);
+	      for (int i = 0; i < batch_size; i++)
+		hash = mix(hash ^ values[i]);
+	    }
+	  else
+	    {
+	      const unsigned __int128 *values = wide(inst);
+	      for (int i = 0; i < batch_size; i++)
+		hash = mix(hash ^ (uint64_t)values[i] ^ mix(values[i] >> 64));
+	    }
+	  hashes[j] = hash;
+	}
+    }
+
+  Inst_map<uint64_t> result;
+  for (size_t j = 0; j < value_insts.size(); j++)
+    result[value_insts[j]] = hashes[j];
+  return result;
+}
+
+} // end anonymous namespace
+
+// Evaluate the check function func on concrete inputs. Returns the result
+// if a counterexample is found, and std::nullopt otherwise.
+std::optional<Solver_result> falsify(Function *func, Check_kind kind)
+{
+  if (config.random_inputs <= 0)
+    return {};
+
+  Falsifier falsifier(func, kind);
+  if (!falsifier.is_supported())
+    return {};
+  return falsifier.run(config.random_inputs);
+}
+
+// Evaluate func on nof_inputs random and boundary inputs, and return a
+// hash of the values of each instruction. Two instructions can only be
+// equal if they have the same hash. The result is empty if func cannot
+// be evaluated.
+Inst_map<uint64_t> simulate(Function *func, int nof_inputs)
+{
+  Falsifier falsifier(func, Check_kind::refine);
+  if (!falsifier.is_supported())
+    return {};
+  return falsifier.simulate(nof_inputs);
+}
+
+} // end namespace smtgcc
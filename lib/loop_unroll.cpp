@@ -23,7 +23,7 @@ class Unroller
   Basic_block *loop_exit;
   Basic_block *loop_body;
   Basic_block *orig_loop_exit;
-  std::map<Instruction *, Instruction *> curr_inst;
+  Inst_map<Instruction *> curr_inst;
 
   std::vector<Basic_block *> loop_bbs;
 
@@ -135,9 +135,8 @@ Basic_block *find_simple_loop(Function *func)
 // variable for the use in this iteration.
 Instruction *Unroller::translate(Instruction *inst)
 {
-  auto I = curr_inst.find(inst);
-  if (I != curr_inst.end())
-    return I->second;
+  if (curr_inst.contains(inst))
+    return curr_inst.at(inst);
   return inst;
 }
 
@@ -241,13 +240,12 @@ void Unroller::unroll()
       // where phi %12 uses the value of phi %10 from the previous iteration.
       // So we must translate all phi nodes before writing the new phi nodes
       // to the translation table.
-      std::map<Instruction *, Instruction *> tmp_curr_inst;
+      std::vector<std::pair<Instruction *, Instruction *>> tmp_curr_inst;
       for (auto phi : loop_header->phis)
 	{
-	  if (loop_body)
-	    tmp_curr_inst[phi] = translate(phi->get_phi_arg(loop_body));
-	  else
-	    tmp_curr_inst[phi] = translate(phi->get_phi_arg(loop_header));
+	  Basic_block *latch = loop_body ? loop_body : loop_header;
+	  Instruction *arg = translate(phi->get_phi_arg(latch));
+	  tmp_curr_inst.push_back({phi, arg});
 	}
       for (auto [phi, translated_phi] : tmp_curr_inst)
 	{
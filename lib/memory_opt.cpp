@@ -146,9 +146,9 @@ void remove_unused_memory(Instruction *memory_inst)
 
 void store_load_forwarding(Function *func)
 {
-  std::map<Basic_block *, std::map<uint64_t, Instruction *>> bb2mem_undef;
-  std::map<Basic_block *, std::map<uint64_t, Instruction *>> bb2mem_flag;
-  std::map<Basic_block *, std::map<uint64_t, Instruction *>> bb2stores;
+  Bb_map<std::map<uint64_t, Instruction *>> bb2mem_undef;
+  Bb_map<std::map<uint64_t, Instruction *>> bb2mem_flag;
+  Bb_map<std::map<uint64_t, Instruction *>> bb2stores;
 
   for (auto bb : func->bbs)
     {
@@ -0,0 +1,102 @@
+// Writes the solver queries to config.dump_dir in SMT-LIB2 format, so
+// that they can be solved again later by smtgcc-replay, e.g., to compare
+// solver versions or options.
+//
+// Each query is stored in its own file, named after the hash of the
+// function and the kind of query. The file starts with comments
+// describing where the query comes from:
+//
+//   ; function: foo
+//   ; passes: ccp -> forwprop
+//   ; check: refine
+//   ; slice: memory 2
+//   ; query: memory
+//
+// The slice line is present when the refinement check is split into
+// slices that are solved separately (the queries are then dumped for each
+// slice), and it names the kind of the slice and its index.
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <unistd.h>
+
+#include "smtgcc.h"
+
+namespace fs = std::filesystem;
+using namespace std::string_literals;
+
+namespace smtgcc {
+
+namespace {
+
+const char *check_name(Check_kind kind)
+{
+  switch (kind)
+    {
+    case Check_kind::refine:
+      return "refine";
+    case Check_kind::ub:
+      return "ub";
+    case Check_kind::assertion:
+      return "assert";
+    }
+  throw Not_implemented("check_name: unknown check kind");
+}
+
+// Write the file atomically, so that smtgcc-replay never sees partially
+// written queries when it runs concurrently with the compiler.
+void write_query(const fs::path& path, const std::string& header,
+		 const std::string& smt2)
+{
+  std::string tmp_path = config.dump_dir + "/tmp.XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0)
+    return;
+  FILE *f = fdopen(fd, "w");
+  if (!f)
+    {
+      close(fd);
+      unlink(tmp_path.c_str());
+      return;
+    }
+  fwrite(header.data(), 1, header.size(), f);
+  fwrite(smt2.data(), 1, smt2.size(), f);
+  bool failed = ferror(f);
+  failed |= fclose(f) != 0;
+  if (failed || rename(tmp_path.c_str(), path.c_str()) != 0)
+    unlink(tmp_path.c_str());
+}
+
+} // end anonymous namespace
+
+void dump_queries(Function *func, Check_kind kind, const Check_origin& origin,
+		  const std::string& slice)
+{
+  if (config.dump_dir.empty())
+    return;
+
+  std::error_code ec;
+  fs::create_directories(config.dump_dir, ec);
+
+  unsigned __int128 hash = func->structural_hash();
+  char hash_str[33];
+  snprintf(hash_str, sizeof(hash_str), "%016" PRIx64 "%016" PRIx64,
+	   (uint64_t)(hash >> 64), (uint64_t)hash);
+
+  for (auto& [query, smt2] : smt2_queries_z3(func, kind))
+    {
+      std::string header;
+      if (!origin.function.empty())
+	header += "; function: " + origin.function + "\n";
+      if (!origin.passes.empty())
+	header += "; passes: " + origin.passes + "\n";
+      header += "; check: "s + check_name(kind) + "\n";
+      if (!slice.empty())
+	header += "; slice: " + slice + "\n";
+      header += "; query: " + query + "\n";
+      std::string name = hash_str + "-"s + check_name(kind) + "-" + query;
+      write_query(fs::path(config.dump_dir) / (name + ".smt2"), header, smt2);
+    }
+}
+
+} // end namespace smtgcc
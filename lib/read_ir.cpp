@@ -757,6 +757,9 @@ void parser::parse(std::string const& file_name)
 
 Module *parse_ir(std::string const& file_name)
 {
+  if (is_binary_ir(file_name))
+    return read_binary_ir(file_name);
+
   parser p;
   p.parse(file_name);
   Module *module = p.module;
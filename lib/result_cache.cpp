@@ -0,0 +1,229 @@
+// An on-disk cache of solver results, used to avoid re-checking functions
+// that have been checked before.
+//
+// Each entry is stored in its own file in config.cache_dir, named after the
+// hash of the function. Entries are written to a temporary file that is
+// then renamed, so concurrent processes never see partially written
+// entries. The modification time is updated when an entry is used, and
+// the least recently used entries are removed when the cache grows
+// larger than config.cache_size.
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+
+#include "smtgcc.h"
+
+namespace fs = std::filesystem;
+
+namespace smtgcc {
+
+namespace {
+
+const char cache_magic[] = "smtgcc-cache 2";
+
+// Mixed into the key of the entries. This must be increased when a change
+// to the checking (e.g., a fix of the SMT encoding) may change the result
+// for a function, so that the results from older versions are not used.
+// It must also be increased when the format of the entries changes.
+const uint64_t cache_version = 3;
+
+// The eviction scans the whole cache directory, so it is only done for
+// one in this many inserted entries.
+const uint64_t eviction_interval = 64;
+
+// Sanity limit on the message length, to avoid trusting corrupted entries.
+const long max_message_len = 1 << 24;
+
+// Temporary files older than this are left from processes that crashed
+// while writing an entry.
+const auto stale_tmp_age = std::chrono::hours(1);
+
+std::string entry_name(unsigned __int128 key)
+{
+  Hasher hasher;
+  hasher.add(cache_version);
+  hasher.add(key >> 64);
+  hasher.add(key);
+  key = hasher.get();
+
+  char buf[33];
+  snprintf(buf, sizeof(buf), "%016" PRIx64 "%016" PRIx64,
+	   (uint64_t)(key >> 64), (uint64_t)key);
+  return buf;
+}
+
+// The statistics of one solver are written as its three times and the
+// skipped flag.
+bool read_stats(FILE *f, SStats& stats)
+{
+  int skipped;
+  if (fscanf(f, " %" SCNu64 " %" SCNu64 " %" SCNu64 " %d", &stats.time[0],
+	     &stats.time[1], &stats.time[2], &skipped) != 4)
+    return false;
+  stats.skipped = skipped;
+  return true;
+}
+
+void write_stats(FILE *f, const SStats& stats)
+{
+  fprintf(f, " %" PRIu64 " %" PRIu64 " %" PRIu64 " %d", stats.time[0],
+	  stats.time[1], stats.time[2], (int)stats.skipped);
+}
+
+bool is_entry_name(const std::string& name)
+{
+  return name.size() == 32
+    && std::all_of(name.begin(), name.end(), [](char c) {
+      return isxdigit(c);
+    });
+}
+
+// Remove the least recently used entries until the cache uses at most
+// 3/4 of the allowed size. Stale temporary files are also removed.
+void evict()
+{
+  struct Entry {
+    fs::file_time_type time;
+    uintmax_t size;
+    fs::path path;
+  };
+  std::vector<Entry> entries;
+  uintmax_t total_size = 0;
+  std::error_code ec;
+  fs::file_time_type now = fs::file_time_type::clock::now();
+  for (auto& dir_entry : fs::directory_iterator(config.cache_dir, ec))
+    {
+      std::string name = dir_entry.path().filename().string();
+      if (name.starts_with("tmp."))
+	{
+	  fs::file_time_type time = dir_entry.last_write_time(ec);
+	  if (!ec && now - time > stale_tmp_age)
+	    fs::remove(dir_entry.path(), ec);
+	  continue;
+	}
+      if (!is_entry_name(name))
+	continue;
+      uintmax_t size = dir_entry.file_size(ec);
+      if (ec)
+	continue;
+      fs::file_time_type time = dir_entry.last_write_time(ec);
+      if (ec)
+	continue;
+      entries.push_back({time, size, dir_entry.path()});
+      total_size += size;
+    }
+
+  uintmax_t max_size = (uintmax_t)config.cache_size * 1024 * 1024;
+  if (total_size <= max_size)
+    return;
+
+  std::sort(entries.begin(), entries.end(),
+	    [](const Entry& a, const Entry& b) {
+	      return a.time < b.time;
+	    });
+  for (auto& entry : entries)
+    {
+      if (total_size <= max_size / 4 * 3)
+	break;
+      // Other processes may have removed the entry already, so errors
+      // are ignored.
+      fs::remove(entry.path, ec);
+      total_size -= entry.size;
+    }
+}
+
+} // end anonymous namespace
+
+std::optional<std::pair<Solver_stats, Solver_result>>
+cache_lookup(unsigned __int128 key)
+{
+  if (config.cache_dir.empty())
+    return {};
+
+  fs::path path = fs::path(config.cache_dir) / entry_name(key);
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    return {};
+
+  std::pair<Solver_stats, Solver_result> entry;
+  auto& [stats, result] = entry;
+  char magic[sizeof(cache_magic)];
+  int status;
+  long message_len;
+  bool valid =
+    fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+    && !memcmp(magic, cache_magic, sizeof(magic) - 1)
+    && magic[sizeof(magic) - 1] == '\n'
+    && fscanf(f, "%d", &status) == 1
+    && read_stats(f, stats.cvc5)
+    && read_stats(f, stats.z3)
+    && fscanf(f, " %ld", &message_len) == 1
+    && (status == (int)Result_status::correct
+	|| status == (int)Result_status::incorrect)
+    && fgetc(f) == '\n';
+  if (valid && message_len > max_message_len)
+    valid = false;
+  if (valid && message_len >= 0)
+    {
+      std::string message(message_len, '\0');
+      valid = fread(message.data(), 1, message_len, f) == (size_t)message_len;
+      result.message = message;
+    }
+  fclose(f);
+  if (!valid)
+    return {};
+  result.status = (Result_status)status;
+
+  // Mark the entry as recently used.
+  std::error_code ec;
+  fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+  return entry;
+}
+
+void cache_insert(unsigned __int128 key, const Solver_stats& stats,
+		  const Solver_result& result)
+{
+  if (config.cache_dir.empty())
+    return;
+  if (result.status == Result_status::unknown)
+    return;
+
+  std::error_code ec;
+  fs::create_directories(config.cache_dir, ec);
+  std::string tmp_path = config.cache_dir + "/tmp.XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0)
+    return;
+  FILE *f = fdopen(fd, "w");
+  if (!f)
+    {
+      close(fd);
+      unlink(tmp_path.c_str());
+      return;
+    }
+  fprintf(f, "%s\n%d", cache_magic, (int)result.status);
+  write_stats(f, stats.cvc5);
+  write_stats(f, stats.z3);
+  fprintf(f, " %ld\n", result.message ? (long)result.message->size() : -1l);
+  if (result.message)
+    fwrite(result.message->data(), 1, result.message->size(), f);
+  bool failed = ferror(f);
+  failed |= fclose(f) != 0;
+  fs::path path = fs::path(config.cache_dir) / entry_name(key);
+  if (failed || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+      unlink(tmp_path.c_str());
+      return;
+    }
+
+  if ((uint64_t)key % eviction_interval == 0)
+    evict();
+}
+
+} // end namespace smtgcc
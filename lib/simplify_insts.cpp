@@ -318,6 +318,25 @@ Instruction *simplify_mem_size(Instruction *inst, const std::map<uint64_t,uint64
   return inst;
 }
 
+Instruction *simplify_array_get_undef(Instruction *inst)
+{
+  // array_get_undef mem_undef_array, x -> 0
+  if (inst->arguments[0]->opcode == Op::MEM_UNDEF_ARRAY)
+    return inst->bb->value_inst(0, inst->bitsize);
+
+  return inst;
+}
+
+Instruction *simplify_array_set_undef(Instruction *inst)
+{
+  // array_set_undef mem_undef_array, x, 0 -> mem_undef_array
+  if (inst->arguments[0]->opcode == Op::MEM_UNDEF_ARRAY
+      && is_value_zero(inst->arguments[2]))
+    return inst->arguments[0];
+
+  return inst;
+}
+
 Instruction *simplify_add(Instruction *inst)
 {
   // add 0, x -> x
@@ -1055,6 +1074,12 @@ Instruction *simplify_inst(Instruction *inst)
     case Op::AND:
       inst = simplify_and(inst);
       break;
+    case Op::ARRAY_GET_UNDEF:
+      inst = simplify_array_get_undef(inst);
+      break;
+    case Op::ARRAY_SET_UNDEF:
+      inst = simplify_array_set_undef(inst);
+      break;
     case Op::ASHR:
       inst = simplify_ashr(inst);
       break;
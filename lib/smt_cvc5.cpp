@@ -1,9 +1,12 @@
 #include "config.h"
 
 #if HAVE_LIBCVC5
+#include <bit>
 #include <cassert>
 #include <cinttypes>
 #include <cvc5/cvc5.h>
+#include <cvc5/cvc5_parser.h>
+#include <sstream>
 
 #include "smtgcc.h"
 
@@ -13,6 +16,11 @@ namespace smtgcc {
 
 namespace {
 
+bool is_value_zero(const Instruction *inst)
+{
+  return inst->opcode == Op::VALUE && inst->value() == 0;
+}
+
 class Converter {
   std::map<const Instruction *, cvc5::Term> inst2array;
   std::map<const Instruction *, cvc5::Term> inst2bv;
@@ -68,6 +76,10 @@ public:
   Instruction *tgt_retval_undef = nullptr;
   Instruction *tgt_unique_ub = nullptr;
   Instruction *tgt_common_ub = nullptr;
+
+  // The memory objects the memory check is limited to (all global
+  // memory is checked if this is empty).
+  std::vector<Instruction *> mem_ids;
 };
 
 cvc5::Term Converter::ite(cvc5::Term c, cvc5::Term a, cvc5::Term b)
@@ -331,6 +343,9 @@ void Converter::build_bv_unary_smt(const Instruction *inst)
     case Op::NOT:
       inst2bv.insert({inst, solver.mkTerm(cvc5::BITVECTOR_NOT, {arg1})});
       break;
+    case Op::CHECK_MEM_ID:
+      mem_ids.push_back(inst->arguments[0]);
+      break;
     case Op::SRC_ASSERT:
       assert(!src_assert);
       src_assert = inst->arguments[0];
@@ -770,16 +785,24 @@ void Converter::convert_function()
   // retval_undef.
   if (src_retval_undef
       && src_retval_undef == tgt_retval_undef
-      && src_retval_undef->opcode == Op::VALUE
-      && !src_retval_undef->value())
+      && is_value_zero(src_retval_undef))
     {
       src_retval_undef = nullptr;
       tgt_retval_undef = nullptr;
     }
 }
 
-Solver_result run_solver(cvc5::Solver& solver, const char *str)
+Solver_result run_solver(cvc5::Solver& solver, const char *str,
+			 Solver_interrupt *interrupt)
 {
+  // cvc5 cannot be interrupted while solving, so we can only avoid
+  // starting new queries after being interrupted.
+  if (interrupt && interrupt->is_interrupted())
+    {
+      std::string msg = "Analysis interrupted ("s + str + ")\n";
+      return {Result_status::unknown, msg};
+    }
+
   cvc5::Result result = solver.checkSat();
   if (result.isUnsat())
     {
@@ -811,7 +834,8 @@ void set_solver_limits(cvc5::Solver& solver)
 
 } // end anonymous namespace
 
-std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
+std::pair<SStats, Solver_result>
+check_refine_cvc5(Function *func, Solver_interrupt *interrupt)
 {
   assert(func->bbs.size() == 1);
 
@@ -830,6 +854,11 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
     solver.mkTerm(cvc5::NOT, {src_unique_ub_term});
   cvc5::Term tgt_unique_ub_term = conv.inst_as_bool(conv.tgt_unique_ub);
 
+  // The preconditions are shared by all queries, so they are asserted
+  // once, and each query is then checked within a push/pop.
+  solver.assertFormula(not_src_common_ub_term);
+  solver.assertFormula(not_src_unique_ub_term);
+
   std::string warning;
   if (conv.src_retval != conv.tgt_retval
       || conv.src_retval_undef != conv.tgt_retval_undef)
@@ -844,11 +873,17 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
 	{
 	  cvc5::Term src_undef = conv.inst_as_bv(conv.src_retval_undef);
 	  cvc5::Term src_mask = solver.mkTerm(cvc5::BITVECTOR_NOT, {src_undef});
-	  src_term = solver.mkTerm(cvc5::BITVECTOR_AND, {src_term, src_mask});
-	  tgt_term = solver.mkTerm(cvc5::BITVECTOR_AND, {tgt_term, src_mask});
+	  if (!is_value_zero(conv.src_retval_undef))
+	    {
+	      src_term =
+		solver.mkTerm(cvc5::BITVECTOR_AND, {src_term, src_mask});
+	      tgt_term =
+		solver.mkTerm(cvc5::BITVECTOR_AND, {tgt_term, src_mask});
+	    }
 
 	  // Check that tgt is not more undef than src.
-	  if (conv.tgt_retval_undef != conv.src_retval_undef)
+	  if (conv.tgt_retval_undef != conv.src_retval_undef
+	      && !is_value_zero(conv.tgt_retval_undef))
 	    {
 	      cvc5::Term tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
 	      cvc5::Term undef_result =
@@ -859,13 +894,11 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
 	    }
 	}
 
-      solver.assertFormula(not_src_common_ub_term);
-      solver.assertFormula(not_src_unique_ub_term);
       cvc5::Term res1 = solver.mkTerm(cvc5::DISTINCT, {src_term, tgt_term});
       cvc5::Term res2 = solver.mkTerm(cvc5::OR, {res1, is_more_undef});
       solver.assertFormula(res2);
       uint64_t start_time = get_time();
-      Solver_result solver_result = run_solver(solver, "retval");
+      Solver_result solver_result = run_solver(solver, "retval", interrupt);
       stats.time[0] = std::max(get_time() - start_time, (uint64_t)1);
       if (solver_result.status == Result_status::incorrect)
 	{
@@ -901,8 +934,6 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
       || conv.src_memory_undef != conv.tgt_memory_undef)
   {
     solver.push();
-    solver.assertFormula(not_src_common_ub_term);
-    solver.assertFormula(not_src_unique_ub_term);
     cvc5::Term src_mem = conv.inst_as_array(conv.src_memory);
     cvc5::Term src_mem_size = conv.inst_as_array(conv.src_memory_size);
     cvc5::Term src_mem_undef = conv.inst_as_array(conv.src_memory_undef);
@@ -912,6 +943,36 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
 
     cvc5::Sort ptr_sort = solver.mkBitVectorSort(func->module->ptr_bits);
     cvc5::Term ptr = solver.mkConst(ptr_sort, ".ptr");
+    if (auto bounds = max_memory_object(conv.src_memory_size))
+      {
+	// The checked address is within a memory object, so we only need
+	// enough bits for the largest id and offset.
+	auto [max_id, max_size] = *bounds;
+	uint32_t ptr_bits = func->module->ptr_bits;
+	uint32_t id_bits = std::max<uint32_t>(std::bit_width(max_id), 1);
+	uint64_t max_offset = max_size > 0 ? max_size - 1 : 0;
+	uint32_t offset_bits = std::max<uint32_t>(std::bit_width(max_offset), 1);
+	assert(id_bits <= func->module->ptr_id_bits);
+	assert(offset_bits <= func->module->ptr_offset_bits);
+	cvc5::Term ptr_id =
+	  solver.mkConst(solver.mkBitVectorSort(id_bits), ".ptr.id");
+	cvc5::Term ptr_offset =
+	  solver.mkConst(solver.mkBitVectorSort(offset_bits), ".ptr.offset");
+	cvc5::Op id_ext_op =
+	  solver.mkOp(cvc5::BITVECTOR_ZERO_EXTEND, {ptr_bits - id_bits});
+	cvc5::Op offset_ext_op =
+	  solver.mkOp(cvc5::BITVECTOR_ZERO_EXTEND, {ptr_bits - offset_bits});
+	ptr_id = solver.mkTerm(id_ext_op, {ptr_id});
+	ptr_offset = solver.mkTerm(offset_ext_op, {ptr_offset});
+	cvc5::Term id_shift =
+	  solver.mkBitVector(ptr_bits, func->module->ptr_id_low);
+	cvc5::Term offset_shift =
+	  solver.mkBitVector(ptr_bits, func->module->ptr_offset_low);
+	ptr_id = solver.mkTerm(cvc5::BITVECTOR_SHL, {ptr_id, id_shift});
+	ptr_offset =
+	  solver.mkTerm(cvc5::BITVECTOR_SHL, {ptr_offset, offset_shift});
+	ptr = solver.mkTerm(cvc5::BITVECTOR_OR, {ptr_id, ptr_offset});
+      }
     uint32_t ptr_id_high = func->module->ptr_id_high;
     uint32_t ptr_id_low = func->module->ptr_id_low;
     cvc5::Op id_op =
@@ -927,6 +988,17 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
     cvc5::Term zero_id = solver.mkBitVector(func->module->ptr_id_bits, 0);
     cvc5::Term cond1 = solver.mkTerm(cvc5::BITVECTOR_SGT, {id, zero_id});
     solver.assertFormula(cond1);
+    if (!conv.mem_ids.empty())
+      {
+	cvc5::Term is_checked_id = solver.mkFalse();
+	for (Instruction *mem_id : conv.mem_ids)
+	  {
+	    cvc5::Term is_id =
+	      solver.mkTerm(cvc5::EQUAL, {id, conv.inst_as_bv(mem_id)});
+	    is_checked_id = solver.mkTerm(cvc5::OR, {is_checked_id, is_id});
+	  }
+	solver.assertFormula(is_checked_id);
+      }
 
     // Only check memory within a memory block.
     cvc5::Term mem_size = solver.mkTerm(cvc5::SELECT, {src_mem_size, id});
@@ -934,25 +1006,35 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
     solver.assertFormula(cond2);
 
     // Check that src and tgt are the same for the bits where src is defined
-    // and that tgt is not more undefined than src.
+    // and that tgt is not more undefined than src. The undef array is
+    // MEM_UNDEF_ARRAY when all memory is defined, and we then skip the
+    // undef checks.
     cvc5::Term src_undef = solver.mkTerm(cvc5::SELECT, {src_mem_undef, ptr});
     cvc5::Term src_mask = solver.mkTerm(cvc5::BITVECTOR_NOT, {src_undef});
     cvc5::Term src_byte = solver.mkTerm(cvc5::SELECT, {src_mem, ptr});
-    src_byte = solver.mkTerm(cvc5::BITVECTOR_AND, {src_byte, src_mask});
     cvc5::Term tgt_byte = solver.mkTerm(cvc5::SELECT, {tgt_mem, ptr});
-    tgt_byte = solver.mkTerm(cvc5::BITVECTOR_AND, {tgt_byte, src_mask});
+    if (conv.src_memory_undef->opcode != Op::MEM_UNDEF_ARRAY)
+      {
+	src_byte = solver.mkTerm(cvc5::BITVECTOR_AND, {src_byte, src_mask});
+	tgt_byte = solver.mkTerm(cvc5::BITVECTOR_AND, {tgt_byte, src_mask});
+      }
     cvc5::Term cond3 = solver.mkTerm(cvc5::DISTINCT, {src_byte, tgt_byte});
     cvc5::Term tgt_undef = solver.mkTerm(cvc5::SELECT, {tgt_mem_undef, ptr});
-    cvc5::Term tgt_more_undef =
-      solver.mkTerm(cvc5::BITVECTOR_AND, {tgt_undef, src_mask});
-    cvc5::Term zero_byte = solver.mkBitVector(8, 0);
-    cvc5::Term cond4 = solver.mkTerm(cvc5::DISTINCT, {tgt_more_undef, zero_byte});
+    cvc5::Term cond4 = solver.mkBoolean(false);
+    if (conv.tgt_memory_undef != conv.src_memory_undef
+	&& conv.tgt_memory_undef->opcode != Op::MEM_UNDEF_ARRAY)
+      {
+	cvc5::Term tgt_more_undef =
+	  solver.mkTerm(cvc5::BITVECTOR_AND, {tgt_undef, src_mask});
+	cvc5::Term zero_byte = solver.mkBitVector(8, 0);
+	cond4 = solver.mkTerm(cvc5::DISTINCT, {tgt_more_undef, zero_byte});
+      }
     solver.assertFormula(solver.mkTerm(cvc5::OR, {cond3, cond4}));
 
     // TODO: Should make a better getBitVectorValue that prints values as
     // hex, etc.
     uint64_t start_time = get_time();
-    Solver_result solver_result = run_solver(solver, "Memory");
+    Solver_result solver_result = run_solver(solver, "Memory", interrupt);
     stats.time[1] = std::max(get_time() - start_time, (uint64_t)1);
     if (solver_result.status == Result_status::incorrect)
       {
@@ -989,11 +1071,9 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
 	   && conv.tgt_unique_ub->value() == 0))
   {
     solver.push();
-    solver.assertFormula(not_src_common_ub_term);
-    solver.assertFormula(not_src_unique_ub_term);
     solver.assertFormula(tgt_unique_ub_term);
     uint64_t start_time = get_time();
-    Solver_result solver_result = run_solver(solver, "UB");
+    Solver_result solver_result = run_solver(solver, "UB", interrupt);
     stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
     if (solver_result.status == Result_status::incorrect)
       return std::pair<SStats, Solver_result>(stats, solver_result);
@@ -1013,7 +1093,8 @@ std::pair<SStats, Solver_result> check_refine_cvc5(Function *func)
   return std::pair<SStats, Solver_result>(stats, {Result_status::correct, {}});
 }
 
-std::pair<SStats, Solver_result> check_ub_cvc5(Function *func)
+std::pair<SStats, Solver_result>
+check_ub_cvc5(Function *func, Solver_interrupt *interrupt)
 {
   assert(func->bbs.size() == 1);
 
@@ -1031,12 +1112,13 @@ std::pair<SStats, Solver_result> check_ub_cvc5(Function *func)
   solver.push();
   solver.assertFormula(ub_term);
   uint64_t start_time = get_time();
-  Solver_result solver_result = run_solver(solver, "UB");
+  Solver_result solver_result = run_solver(solver, "UB", interrupt);
   stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
   return std::pair<SStats, Solver_result>(stats, solver_result);
 }
 
-std::pair<SStats, Solver_result> check_assert_cvc5(Function *func)
+std::pair<SStats, Solver_result>
+check_assert_cvc5(Function *func, Solver_interrupt *interrupt)
 {
   assert(func->bbs.size() == 1);
 
@@ -1058,11 +1140,51 @@ std::pair<SStats, Solver_result> check_assert_cvc5(Function *func)
   solver.assertFormula(not_unique_ub_term);
   solver.assertFormula(assert_term);
   uint64_t start_time = get_time();
-  Solver_result solver_result = run_solver(solver, "UB");
+  Solver_result solver_result = run_solver(solver, "UB", interrupt);
   stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
   return std::pair<SStats, Solver_result>(stats, solver_result);
 }
 
+// Solve a query in SMT-LIB2 format. The status is correct if the query
+// is unsat, and incorrect if it is sat.
+Solver_result solve_smt2_cvc5(const std::string& smt2)
+{
+  cvc5::Solver solver;
+  char buf[32];
+  sprintf(buf, "%d", config.timeout);
+  solver.setOption("tlimit-per", buf);
+
+  // Run all commands except check-sat, which is done below so that we
+  // get the result.
+  try
+    {
+      cvc5::parser::InputParser parser(&solver);
+      parser.setStringInput(cvc5::modes::InputLanguage::SMT_LIB_2_6, smt2,
+			    "query");
+      std::ostringstream out;
+      for (;;)
+	{
+	  cvc5::parser::Command cmd = parser.nextCommand();
+	  if (cmd.isNull())
+	    break;
+	  if (cmd.getCommandName() == "check-sat")
+	    continue;
+	  cmd.invoke(&solver, parser.getSymbolManager(), out);
+	}
+    }
+  catch (cvc5::CVC5ApiException& error)
+    {
+      throw Parse_error(error.getMessage(), 0);
+    }
+
+  cvc5::Result result = solver.checkSat();
+  if (result.isUnsat())
+    return {Result_status::correct, {}};
+  if (result.isSat())
+    return {Result_status::incorrect, {}};
+  return {Result_status::unknown, result.toString() + "\n"};
+}
+
 } // end namespace smtgcc
 
 #else
@@ -1071,7 +1193,25 @@ std::pair<SStats, Solver_result> check_assert_cvc5(Function *func)
 
 namespace smtgcc {
 
-SStats verify_cvc5(Function *, Function *)
+std::pair<SStats, Solver_result>
+check_refine_cvc5(Function *, Solver_interrupt *)
+{
+  throw Not_implemented("cvc5 is not available");
+}
+
+std::pair<SStats, Solver_result>
+check_ub_cvc5(Function *, Solver_interrupt *)
+{
+  throw Not_implemented("cvc5 is not available");
+}
+
+std::pair<SStats, Solver_result>
+check_assert_cvc5(Function *, Solver_interrupt *)
+{
+  throw Not_implemented("cvc5 is not available");
+}
+
+Solver_result solve_smt2_cvc5(const std::string&)
 {
   throw Not_implemented("cvc5 is not available");
 }
@@ -1,8 +1,17 @@
 #include "config.h"
 
 #if HAVE_LIBZ3
+#include <array>
+#include <bit>
 #include <cassert>
 #include <cinttypes>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 #include <z3++.h>
 
 #include "smtgcc.h"
@@ -13,6 +22,29 @@ namespace smtgcc {
 
 namespace {
 
+// The terms built for an instruction.
+struct Cached_terms {
+  std::optional<z3::expr> array;
+  std::optional<z3::expr> bv;
+  std::optional<z3::expr> fp;
+  std::optional<z3::expr> boolean;
+};
+
+struct Hash128 {
+  size_t operator()(unsigned __int128 x) const
+  {
+    return (uint64_t)x ^ (uint64_t)(x >> 64);
+  }
+};
+
+// Maps the structural hash of an instruction to the terms built for it.
+using Term_cache = std::unordered_map<unsigned __int128, Cached_terms, Hash128>;
+
+bool is_value_zero(const Instruction *inst)
+{
+  return inst->opcode == Op::VALUE && inst->value() == 0;
+}
+
 class Converter {
   std::map<const Instruction *, z3::expr> inst2array;
   std::map<const Instruction *, z3::expr> inst2bv;
@@ -35,11 +67,13 @@ class Converter {
   void convert_function();
 
   z3::context& ctx;
-  const Function *func;
+  Term_cache *term_cache;
 
 public:
-  Converter(z3::context& ctx, const Function *func)
+  Converter(z3::context& ctx, const Function *func,
+	    Term_cache *term_cache = nullptr)
     : ctx{ctx}
+    , term_cache{term_cache}
     , func{func}
   {
     convert_function();
@@ -49,6 +83,8 @@ public:
   z3::expr inst_as_fp(const Instruction *inst);
   z3::expr inst_as_bool(const Instruction *inst);
 
+  const Function *func;
+
   Instruction *src_assert = nullptr;
   Instruction *src_memory = nullptr;
   Instruction *src_memory_flag = nullptr;
@@ -68,6 +104,10 @@ public:
   Instruction *tgt_retval_undef = nullptr;
   Instruction *tgt_unique_ub = nullptr;
   Instruction *tgt_common_ub = nullptr;
+
+  // The memory objects the memory check is limited to (all global
+  // memory is checked if this is empty).
+  std::vector<Instruction *> mem_ids;
 };
 
 z3::expr Converter::ite(z3::expr c, z3::expr a, z3::expr b)
@@ -341,6 +381,9 @@ void Converter::build_bv_unary_smt(const Instruction *inst)
     case Op::NOT:
       inst2bv.insert({inst, ~arg1});
       break;
+    case Op::CHECK_MEM_ID:
+      mem_ids.push_back(inst->arguments[0]);
+      break;
     case Op::SRC_ASSERT:
       assert(!src_assert);
       src_assert = inst->arguments[0];
@@ -798,12 +841,77 @@ void Converter::build_smt(const Instruction *inst)
 
 void Converter::convert_function()
 {
+  // The hash of an instruction is calculated from the hashes of its
+  // arguments, so identical expressions in different functions get
+  // the same hash, and can use the terms from term_cache.
+  Hasher seed;
+  seed.add(func->module->ptr_bits);
+  seed.add(func->module->ptr_id_bits);
+  seed.add(func->module->ptr_offset_bits);
+  Inst_map<unsigned __int128> inst2hash;
+
   for (auto bb : func->bbs)
     {
       assert(bb->phis.empty());
       for (Instruction *inst = bb->first_inst; inst; inst = inst->next)
 	{
+	  if (!term_cache)
+	    {
+	      build_smt(inst);
+	      continue;
+	    }
+
+	  Hasher hasher = seed;
+	  hasher.add((uint64_t)inst->opcode << 32 | inst->nof_args);
+	  hasher.add(inst->bitsize);
+	  if (inst->opcode == Op::VALUE)
+	    {
+	      hasher.add(inst->value());
+	      hasher.add(inst->value() >> 64);
+	    }
+	  for (uint16_t i = 0; i < inst->nof_args; i++)
+	    {
+	      unsigned __int128 arg_hash = inst2hash.at(inst->arguments[i]);
+	      hasher.add(arg_hash);
+	      hasher.add(arg_hash >> 64);
+	    }
+	  unsigned __int128 hash = hasher.get();
+	  inst2hash[inst] = hash;
+
+	  // Instructions without a result, such as SRC_RETVAL, must be
+	  // processed for each function, so they are not cached. Neither
+	  // is VALUE, as it is cheap to build.
+	  if (!inst->has_lhs() || inst->opcode == Op::VALUE)
+	    {
+	      build_smt(inst);
+	      continue;
+	    }
+
+	  auto I = term_cache->find(hash);
+	  if (I != term_cache->end())
+	    {
+	      const Cached_terms& terms = I->second;
+	      if (terms.array)
+		inst2array.insert({inst, *terms.array});
+	      if (terms.bv)
+		inst2bv.insert({inst, *terms.bv});
+	      if (terms.fp)
+		inst2fp.insert({inst, *terms.fp});
+	      if (terms.boolean)
+		inst2bool.insert({inst, *terms.boolean});
+	      continue;
+	    }
+
 	  build_smt(inst);
+	  Cached_terms& terms = (*term_cache)[hash];
+	  if (auto J = inst2array.find(inst); J != inst2array.end())
+	    terms.array = J->second;
+	  if (auto J = inst2bv.find(inst); J != inst2bv.end())
+	    terms.bv = J->second;
+	  if (auto J = inst2fp.find(inst); J != inst2fp.end())
+	    terms.fp = J->second;
+	  if (auto J = inst2bool.find(inst); J != inst2bool.end())
+	    terms.boolean = J->second;
 	}
     }
 
@@ -811,8 +919,7 @@ void Converter::convert_function()
   // retval_undef.
   if (src_retval_undef
       && src_retval_undef == tgt_retval_undef
-      && src_retval_undef->opcode == Op::VALUE
-      && !src_retval_undef->value())
+      && is_value_zero(src_retval_undef))
     {
       src_retval_undef = nullptr;
       tgt_retval_undef = nullptr;
@@ -832,6 +939,10 @@ Solver_result run_solver(z3::solver& s, const char *str)
 	{
 	  z3::func_decl v = m[i];
 	  std::string name = v.name().str();
+	  // The id and offset of .ptr are internal to the memory check;
+	  // .ptr itself is printed with the memory values.
+	  if (name.starts_with(".ptr."))
+	    continue;
 	  std::string value = m.get_const_interp(v).to_string();
 	  msg = msg + name + " = " + value + "\n";
 	}
@@ -847,6 +958,17 @@ Solver_result run_solver(z3::solver& s, const char *str)
 
 void set_solver_limits()
 {
+  // The limits are global parameters in z3, so they only need to be
+  // set when they change.
+  static std::mutex mutex;
+  static int timeout = -1;
+  static int memory_limit = -1;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (config.timeout == timeout && config.memory_limit == memory_limit)
+    return;
+  timeout = config.timeout;
+  memory_limit = config.memory_limit;
+
   char buf[32];
   sprintf(buf, "%d", config.timeout);
   Z3_global_param_set("timeout", buf);
@@ -854,173 +976,583 @@ void set_solver_limits()
   Z3_global_param_set("memory_high_watermark", buf);
 }
 
-} // end anonymous namespace
+// The timeout also applies to the simplifications done when building the
+// terms, and z3 throws an exception if it expires there. This is reported
+// in the same way as a solver timeout.
+bool is_timeout(const z3::exception& error)
+{
+  return !strcmp(error.msg(), "canceled");
+}
 
-std::pair<SStats, Solver_result> check_refine_z3(Function *func)
+Solver_result timed_out()
 {
-  assert(func->bbs.size() == 1);
+  return {Result_status::unknown, "Analysis timed out\n"};
+}
 
+// A z3 context that is reused between checks, together with a cache of
+// the terms built for the instructions. This avoids the cost of creating
+// a context for each check, and of building the terms again for code
+// that is common between the functions checked in a compilation.
+struct Session {
   z3::context ctx;
-  set_solver_limits();
+  Term_cache term_cache;
+  int nof_uses = 0;
+};
 
-  SStats stats;
-  stats.skipped = false;
+// The context keeps all terms that have been created alive, so the
+// sessions are discarded after this many checks to limit memory use.
+const int max_session_uses = 1000;
 
-  Converter conv(ctx, func);
-  z3::expr src_common_ub_expr = conv.inst_as_bool(conv.src_common_ub);
-  z3::expr src_unique_ub_expr = conv.inst_as_bool(conv.src_unique_ub);
-  z3::expr tgt_unique_ub_expr = conv.inst_as_bool(conv.tgt_unique_ub);
+// Maximum number of instructions in a session's term cache.
+const size_t max_cached_terms = 1000000;
 
-  std::string warning;
-  if (conv.src_retval != conv.tgt_retval
-      || conv.src_retval_undef != conv.tgt_retval_undef)
+// Sessions that are not currently in use. The pool is not freed at exit,
+// as there is no need to destroy the contexts then.
+std::mutex session_pool_mutex;
+std::vector<std::unique_ptr<Session>> *session_pool =
+  new std::vector<std::unique_ptr<Session>>;
+
+// Gives exclusive use of a session while the object is alive. The session
+// is taken from the pool (or created if the pool is empty), and returned
+// to the pool when the object is destroyed.
+class Session_ref {
+  std::unique_ptr<Session> session;
+  int nof_uncaught_exceptions;
+
+public:
+  Session_ref();
+  ~Session_ref();
+  z3::context& ctx()
+  {
+    return session->ctx;
+  }
+  Term_cache *term_cache()
+  {
+    return &session->term_cache;
+  }
+};
+
+Session_ref::Session_ref()
+  : nof_uncaught_exceptions{std::uncaught_exceptions()}
+{
+  {
+    std::lock_guard<std::mutex> lock(session_pool_mutex);
+    if (!session_pool->empty())
+      {
+	session = std::move(session_pool->back());
+	session_pool->pop_back();
+      }
+  }
+  if (!session)
+    session = std::make_unique<Session>();
+}
+
+Session_ref::~Session_ref()
+{
+  // The session may be in an inconsistent state if the check failed.
+  if (std::uncaught_exceptions() > nof_uncaught_exceptions)
+    return;
+  if (++session->nof_uses >= max_session_uses)
+    return;
+  if (session->term_cache.size() > max_cached_terms)
+    session->term_cache.clear();
+
+  std::lock_guard<std::mutex> lock(session_pool_mutex);
+  uint64_t memory_limit = (uint64_t)config.memory_limit * 1024 * 1024;
+  if (Z3_get_estimated_alloc_size() > memory_limit / 2)
     {
-      assert(conv.src_retval && conv.tgt_retval);
-      z3::expr src_expr = conv.inst_as_bv(conv.src_retval);
-      z3::expr tgt_expr = conv.inst_as_bv(conv.tgt_retval);
+      // Discard all sessions to free the memory used by the contexts.
+      session_pool->clear();
+      return;
+    }
+  session_pool->push_back(std::move(session));
+}
 
-      z3::expr is_more_undef = ctx.bool_val(false);
-      if (conv.src_retval_undef)
+// The queries made by check_refine_z3, in the priority order used when
+// several of them find the transformation to be incorrect.
+enum Query {
+  retval_query,
+  memory_query,
+  ub_query,
+  nof_queries
+};
+
+// The queries are independent, so check_refine_z3 runs them in parallel,
+// each in its own thread and session. When a query finds that the
+// transformation is incorrect, the lower priority queries are cancelled
+// as their result would not be used anyway. All queries are cancelled if
+// check_refine_z3 is interrupted.
+class Query_runner {
+  std::array<Solver_interrupt, nof_queries> interrupts;
+
+public:
+  Solver_interrupt *interrupt(Query query)
+  {
+    return &interrupts[query];
+  }
+  bool is_cancelled(Query query)
+  {
+    return interrupts[query].is_interrupted();
+  }
+  // Cancel query first and all queries with lower priority.
+  void cancel_from(int first)
+  {
+    for (int i = first; i < nof_queries; i++)
+      interrupts[i].interrupt();
+  }
+};
+
+// Add the preconditions that are shared by all queries.
+void add_preconditions(Converter& conv, z3::solver& solver)
+{
+  solver.add(!conv.inst_as_bool(conv.src_common_ub));
+  solver.add(!conv.inst_as_bool(conv.src_unique_ub));
+}
+
+// Check that tgt's return value refines src's. Returns std::nullopt if
+// the query is not needed or if it was cancelled.
+std::optional<Solver_result> check_retval(Converter& conv, z3::solver& solver,
+					  SStats& stats, Query_runner *runner)
+{
+  if (conv.src_retval == conv.tgt_retval
+      && conv.src_retval_undef == conv.tgt_retval_undef)
+    return {};
+
+  z3::context& ctx = solver.ctx();
+  assert(conv.src_retval && conv.tgt_retval);
+  z3::expr src_expr = conv.inst_as_bv(conv.src_retval);
+  z3::expr tgt_expr = conv.inst_as_bv(conv.tgt_retval);
+
+  z3::expr is_more_undef = ctx.bool_val(false);
+  if (conv.src_retval_undef)
+    {
+      z3::expr src_undef = conv.inst_as_bv(conv.src_retval_undef);
+      z3::expr tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
+      z3::expr src_mask = ~src_undef;
+      if (!is_value_zero(conv.src_retval_undef))
 	{
-	  z3::expr src_undef = conv.inst_as_bv(conv.src_retval_undef);
-	  z3::expr tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
-	  z3::expr src_mask = ~src_undef;
 	  z3::expr new_src_expr = src_expr & src_mask;
 	  src_expr = new_src_expr;
 	  z3::expr new_tgt_expr = tgt_expr & src_mask;
 	  tgt_expr = new_tgt_expr;
-
-	  // Check that tgt is not more undef than src.
-	  if (conv.tgt_retval_undef != conv.src_retval_undef)
-	    {
-	      z3::expr new_tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
-	      tgt_undef = new_tgt_undef;
-	      z3::expr new_is_more_undef = (src_mask & tgt_undef) != 0;
-	      is_more_undef = new_is_more_undef;
-	    }
 	}
 
-      z3::solver solver(ctx);
-      solver.add(!src_common_ub_expr);
-      solver.add(!src_unique_ub_expr);
-      solver.add((src_expr != tgt_expr) || is_more_undef);
-      uint64_t start_time = get_time();
-      Solver_result solver_result = run_solver(solver, "retval");
-      stats.time[0] = std::max(get_time() - start_time, (uint64_t)1);
-      if (solver_result.status == Result_status::incorrect)
+      // Check that tgt is not more undef than src.
+      if (conv.tgt_retval_undef != conv.src_retval_undef
+	  && !is_value_zero(conv.tgt_retval_undef))
 	{
-	  assert(solver_result.message);
-	  z3::model model = solver.get_model();
-	  std::string msg = *solver_result.message;
-	  msg = msg + "src retval: " + model.eval(src_expr).to_string() + "\n";
-	  msg = msg + "tgt retval: " + model.eval(tgt_expr).to_string() + "\n";
-	  if (conv.src_retval_undef)
-	    {
-	      z3::expr src_undef = conv.inst_as_bv(conv.src_retval_undef);
-	      z3::expr tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
-	      msg = msg + "src undef: " + model.eval(src_undef).to_string() + "\n";
-	      msg = msg +  "tgt undef: " + model.eval(tgt_undef).to_string() + "\n";
-	    }
-	  Solver_result result = {Result_status::incorrect, msg};
-	  return std::pair<SStats, Solver_result>(stats, result);
+	  z3::expr new_tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
+	  tgt_undef = new_tgt_undef;
+	  z3::expr new_is_more_undef = (src_mask & tgt_undef) != 0;
+	  is_more_undef = new_is_more_undef;
 	}
-      if (solver_result.status == Result_status::unknown)
+    }
+
+  solver.add((src_expr != tgt_expr) || is_more_undef);
+  if (runner && runner->is_cancelled(retval_query))
+    return {};
+  uint64_t start_time = get_time();
+  Solver_result solver_result = run_solver(solver, "retval");
+  stats.time[0] = std::max(get_time() - start_time, (uint64_t)1);
+  if (solver_result.status == Result_status::incorrect)
+    {
+      if (runner)
+	runner->cancel_from(retval_query + 1);
+      assert(solver_result.message);
+      z3::model model = solver.get_model();
+      std::string msg = *solver_result.message;
+      msg = msg + "src retval: " + model.eval(src_expr).to_string() + "\n";
+      msg = msg + "tgt retval: " + model.eval(tgt_expr).to_string() + "\n";
+      if (conv.src_retval_undef)
 	{
-	  assert(solver_result.message);
-	  warning = warning + *solver_result.message;
+	  z3::expr src_undef = conv.inst_as_bv(conv.src_retval_undef);
+	  z3::expr tgt_undef = conv.inst_as_bv(conv.tgt_retval_undef);
+	  msg = msg + "src undef: " + model.eval(src_undef).to_string() + "\n";
+	  msg = msg +  "tgt undef: " + model.eval(tgt_undef).to_string() + "\n";
 	}
+      return Solver_result{Result_status::incorrect, msg};
     }
+  return solver_result;
+}
 
-  // Check that the global memory is consistent for src and tgt.
-  if (conv.src_memory != conv.tgt_memory
-      || conv.src_memory_size != conv.tgt_memory_size
-      || conv.src_memory_undef != conv.tgt_memory_undef)
-  {
-    z3::expr src_mem = conv.inst_as_array(conv.src_memory);
-    z3::expr src_mem_size = conv.inst_as_array(conv.src_memory_size);
-    z3::expr src_mem_undef = conv.inst_as_array(conv.src_memory_undef);
-
-    z3::expr tgt_mem = conv.inst_as_array(conv.tgt_memory);
-    z3::expr tgt_mem_undef = conv.inst_as_array(conv.tgt_memory_undef);
-
-    z3::expr ptr = ctx.bv_const(".ptr", func->module->ptr_bits);
-    uint32_t ptr_id_high = func->module->ptr_id_high;
-    uint32_t ptr_id_low = func->module->ptr_id_low;
-    z3::expr id = ptr.extract(ptr_id_high, ptr_id_low);
-    uint32_t ptr_offset_high = func->module->ptr_offset_high;
-    uint32_t ptr_offset_low = func->module->ptr_offset_low;
-    z3::expr offset = ptr.extract(ptr_offset_high, ptr_offset_low);
-
-    z3::solver solver(ctx);
-    solver.add(!src_common_ub_expr);
-    solver.add(!src_unique_ub_expr);
-
-    // Only check global memory.
-    solver.add(id > 0);
-
-    // Only check memory within a memory block.
-    solver.add(z3::ult(offset, z3::select(src_mem_size, id)));
-
-    // Check that src and tgt are the same for the bits where src is defined
-    // and that tgt is not more undefined than src.
-    z3::expr src_mask = ~z3::select(src_mem_undef, ptr);
-    z3::expr src_value = z3::select(src_mem, ptr) & src_mask;
-    z3::expr tgt_value = z3::select(tgt_mem, ptr) & src_mask;
-    z3::expr tgt_more_undef = (z3::select(tgt_mem_undef, ptr) & src_mask) != 0;
-    solver.add(src_value != tgt_value || tgt_more_undef);
-
-    uint64_t start_time = get_time();
-    Solver_result solver_result = run_solver(solver, "Memory");
-    stats.time[1] = std::max(get_time() - start_time, (uint64_t)1);
-    if (solver_result.status == Result_status::incorrect)
-      {
-	assert(solver_result.message);
-	z3::model model = solver.get_model();
-	z3::expr src_byte = model.eval(z3::select(src_mem, ptr));
-	z3::expr tgt_byte = model.eval(z3::select(tgt_mem, ptr));
-	z3::expr src_undef = model.eval(z3::select(src_mem_undef, ptr));
-	z3::expr tgt_undef = model.eval(z3::select(tgt_mem_undef, ptr));
-	std::string msg = *solver_result.message;
-	msg = msg + "\n.ptr = " + model.eval(ptr).to_string() + "\n";
-	msg = msg + "src *.ptr: " + src_byte.to_string() + "\n";
-	msg = msg + "tgt *.ptr: " + tgt_byte.to_string() + "\n";
-	msg = msg + "src undef: " + src_undef.to_string() + "\n";
-	msg = msg + "tgt undef: " + tgt_undef.to_string() + "\n";
-	Solver_result result = {Result_status::incorrect, msg};
-	return std::pair<SStats, Solver_result>(stats, result);
-      }
-    if (solver_result.status == Result_status::unknown)
-      {
-	assert(solver_result.message);
-	warning = warning + *solver_result.message;
-      }
-  }
+// Check that the global memory is consistent for src and tgt. Returns
+// std::nullopt if the query is not needed or if it was cancelled.
+std::optional<Solver_result> check_memory(Converter& conv, z3::solver& solver,
+					  SStats& stats, Query_runner *runner)
+{
+  if (conv.src_memory == conv.tgt_memory
+      && conv.src_memory_size == conv.tgt_memory_size
+      && conv.src_memory_undef == conv.tgt_memory_undef)
+    return {};
+
+  z3::context& ctx = solver.ctx();
+  const Module *module = conv.func->module;
+  z3::expr src_mem = conv.inst_as_array(conv.src_memory);
+  z3::expr src_mem_size = conv.inst_as_array(conv.src_memory_size);
+  z3::expr src_mem_undef = conv.inst_as_array(conv.src_memory_undef);
+
+  z3::expr tgt_mem = conv.inst_as_array(conv.tgt_memory);
+  z3::expr tgt_mem_undef = conv.inst_as_array(conv.tgt_memory_undef);
+
+  z3::expr ptr = ctx.bv_const(".ptr", module->ptr_bits);
+  if (auto bounds = max_memory_object(conv.src_memory_size))
+    {
+      // The checked address is within a memory object, so we only need
+      // enough bits for the largest id and offset.
+      auto [max_id, max_size] = *bounds;
+      uint32_t id_bits = std::max<uint32_t>(std::bit_width(max_id), 1);
+      uint64_t max_offset = max_size > 0 ? max_size - 1 : 0;
+      uint32_t offset_bits = std::max<uint32_t>(std::bit_width(max_offset), 1);
+      assert(id_bits <= module->ptr_id_bits);
+      assert(offset_bits <= module->ptr_offset_bits);
+      z3::expr ptr_id = ctx.bv_const(".ptr.id", id_bits);
+      z3::expr ptr_offset = ctx.bv_const(".ptr.offset", offset_bits);
+      ptr_id = z3::zext(ptr_id, module->ptr_bits - id_bits);
+      ptr_offset = z3::zext(ptr_offset, module->ptr_bits - offset_bits);
+      ptr = z3::shl(ptr_id, module->ptr_id_low)
+	| z3::shl(ptr_offset, module->ptr_offset_low);
+    }
+  uint32_t ptr_id_high = module->ptr_id_high;
+  uint32_t ptr_id_low = module->ptr_id_low;
+  z3::expr id = ptr.extract(ptr_id_high, ptr_id_low);
+  uint32_t ptr_offset_high = module->ptr_offset_high;
+  uint32_t ptr_offset_low = module->ptr_offset_low;
+  z3::expr offset = ptr.extract(ptr_offset_high, ptr_offset_low);
+
+  // Only check global memory.
+  solver.add(id > 0);
+  if (!conv.mem_ids.empty())
+    {
+      z3::expr is_checked_id = ctx.bool_val(false);
+      for (Instruction *mem_id : conv.mem_ids)
+	is_checked_id = is_checked_id || id == conv.inst_as_bv(mem_id);
+      solver.add(is_checked_id);
+    }
+
+  // Only check memory within a memory block.
+  solver.add(z3::ult(offset, z3::select(src_mem_size, id)));
+
+  // Check that src and tgt are the same for the bits where src is defined
+  // and that tgt is not more undefined than src. The undef array is
+  // MEM_UNDEF_ARRAY when all memory is defined, and we then skip the
+  // undef checks.
+  z3::expr src_mask = ~z3::select(src_mem_undef, ptr);
+  z3::expr src_value = z3::select(src_mem, ptr);
+  z3::expr tgt_value = z3::select(tgt_mem, ptr);
+  if (conv.src_memory_undef->opcode != Op::MEM_UNDEF_ARRAY)
+    {
+      z3::expr new_src_value = src_value & src_mask;
+      src_value = new_src_value;
+      z3::expr new_tgt_value = tgt_value & src_mask;
+      tgt_value = new_tgt_value;
+    }
+  z3::expr tgt_more_undef = ctx.bool_val(false);
+  if (conv.tgt_memory_undef != conv.src_memory_undef
+      && conv.tgt_memory_undef->opcode != Op::MEM_UNDEF_ARRAY)
+    tgt_more_undef = (z3::select(tgt_mem_undef, ptr) & src_mask) != 0;
+  solver.add(src_value != tgt_value || tgt_more_undef);
+
+  if (runner && runner->is_cancelled(memory_query))
+    return {};
+  uint64_t start_time = get_time();
+  Solver_result solver_result = run_solver(solver, "Memory");
+  stats.time[1] = std::max(get_time() - start_time, (uint64_t)1);
+  if (solver_result.status == Result_status::incorrect)
+    {
+      if (runner)
+	runner->cancel_from(memory_query + 1);
+      assert(solver_result.message);
+      z3::model model = solver.get_model();
+      z3::expr src_byte = model.eval(z3::select(src_mem, ptr));
+      z3::expr tgt_byte = model.eval(z3::select(tgt_mem, ptr));
+      z3::expr src_undef = model.eval(z3::select(src_mem_undef, ptr));
+      z3::expr tgt_undef = model.eval(z3::select(tgt_mem_undef, ptr));
+      std::string msg = *solver_result.message;
+      msg = msg + "\n.ptr = " + model.eval(ptr).to_string() + "\n";
+      msg = msg + "src *.ptr: " + src_byte.to_string() + "\n";
+      msg = msg + "tgt *.ptr: " + tgt_byte.to_string() + "\n";
+      msg = msg + "src undef: " + src_undef.to_string() + "\n";
+      msg = msg + "tgt undef: " + tgt_undef.to_string() + "\n";
+      return Solver_result{Result_status::incorrect, msg};
+    }
+  return solver_result;
+}
 
-  // Check that tgt does not have UB that is not in src.
-  //
-  // This should be the last check as UB that does not change the result
-  // has low priority.
+// Check that tgt does not have UB that is not in src. Returns std::nullopt
+// if the query is not needed or if it was cancelled.
+std::optional<Solver_result> check_tgt_ub(Converter& conv, z3::solver& solver,
+					  SStats& stats, Query_runner *runner)
+{
   assert(conv.src_common_ub == conv.tgt_common_ub);
-  if (conv.src_unique_ub != conv.tgt_unique_ub
-      && !(conv.tgt_unique_ub->opcode == Op::VALUE
-	   && conv.tgt_unique_ub->value() == 0))
+  if (conv.src_unique_ub == conv.tgt_unique_ub
+      || (conv.tgt_unique_ub->opcode == Op::VALUE
+	  && conv.tgt_unique_ub->value() == 0))
+    return {};
+
+  solver.add(conv.inst_as_bool(conv.tgt_unique_ub));
+  if (runner && runner->is_cancelled(ub_query))
+    return {};
+  uint64_t start_time = get_time();
+  Solver_result solver_result = run_solver(solver, "UB");
+  stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
+  return solver_result;
+}
+
+// The query made by check_ub_z3: that src has UB.
+void add_ub_query(Converter& conv, z3::solver& solver)
+{
+  z3::expr src_unique_ub_expr = conv.inst_as_bool(conv.src_unique_ub);
+  z3::expr src_common_ub_expr = conv.inst_as_bool(conv.src_common_ub);
+  solver.add(src_common_ub_expr || src_unique_ub_expr);
+}
+
+// The query made by check_assert_z3: that an assert fails in src without
+// UB.
+void add_assert_query(Converter& conv, z3::solver& solver)
+{
+  solver.add(!conv.inst_as_bool(conv.src_common_ub));
+  solver.add(!conv.inst_as_bool(conv.src_unique_ub));
+  solver.add(conv.inst_as_bool(conv.src_assert));
+}
+
+using Query_results = std::array<std::optional<Solver_result>, nof_queries>;
+
+// The names of the queries in the dumped SMT-LIB2 files.
+const char *const query_names[nof_queries] = {
+  "retval",
+  "memory",
+  "ub"
+};
+
+std::optional<Solver_result> (*const query_checks[nof_queries])(
+  Converter&, z3::solver&, SStats&, Query_runner *) = {
+  check_retval,
+  check_memory,
+  check_tgt_ub
+};
+
+// Return false if the src and tgt values checked by query are identical,
+// so that the query is not needed. This is checked from the marker
+// instructions, so that run_queries_parallel does not need to create
+// sessions for the queries that are not needed. The query functions make
+// a more precise check, so this may return true for some queries that
+// are not needed.
+bool is_needed(Function *func, Query query)
+{
+  std::array<Op, 2> src_ops;
+  std::array<Op, 2> tgt_ops;
+  switch (query)
+    {
+    case retval_query:
+      src_ops = {Op::SRC_RETVAL, Op::SRC_RETVAL};
+      tgt_ops = {Op::TGT_RETVAL, Op::TGT_RETVAL};
+      break;
+    case memory_query:
+      src_ops = {Op::SRC_MEM1, Op::SRC_MEM2};
+      tgt_ops = {Op::TGT_MEM1, Op::TGT_MEM2};
+      break;
+    case ub_query:
+      src_ops = {Op::SRC_UB, Op::SRC_UB};
+      tgt_ops = {Op::TGT_UB, Op::TGT_UB};
+      break;
+    default:
+      return true;
+    }
+
+  std::map<Op, Instruction *> markers;
+  for (Instruction *inst = func->bbs[0]->first_inst; inst; inst = inst->next)
+    {
+      if (!inst->has_lhs())
+	markers[inst->opcode] = inst;
+    }
+  for (int i = 0; i < 2; i++)
+    {
+      Instruction *src_inst = markers[src_ops[i]];
+      Instruction *tgt_inst = markers[tgt_ops[i]];
+      if (!src_inst || !tgt_inst)
+	{
+	  if (src_inst != tgt_inst)
+	    return true;
+	  continue;
+	}
+      for (uint16_t j = 0; j < src_inst->nof_args; j++)
+	{
+	  if (src_inst->arguments[j] != tgt_inst->arguments[j])
+	    return true;
+	}
+    }
+  return false;
+}
+
+// Run the queries in parallel, as described for Query_runner.
+Query_results run_queries_parallel(Function *func, SStats& stats,
+				   Solver_interrupt *interrupt)
+{
+  Query_runner runner;
+  Query_results results;
+  std::array<std::exception_ptr, nof_queries> exceptions;
+  std::vector<std::thread> threads;
   {
-    z3::solver solver(ctx);
-    solver.add(!src_common_ub_expr);
-    solver.add(!src_unique_ub_expr);
-    solver.add(tgt_unique_ub_expr);
-    uint64_t start_time = get_time();
-    Solver_result solver_result = run_solver(solver, "UB");
-    stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
-    if (solver_result.status == Result_status::incorrect)
-      return std::pair<SStats, Solver_result>(stats, solver_result);
-    if (solver_result.status == Result_status::unknown)
+    Solver_interrupt::Scope scope(interrupt, [&runner]() {
+      runner.cancel_from(0);
+    });
+    for (int i = 0; i < nof_queries; i++)
       {
-	assert(solver_result.message);
-	warning = warning + *solver_result.message;
+	if (!is_needed(func, (Query)i))
+	  continue;
+	threads.emplace_back([&, i]() {
+	  try
+	    {
+	      Session_ref session;
+	      Solver_interrupt::Scope scope(runner.interrupt((Query)i),
+					    [&session]() {
+		session.ctx().interrupt();
+	      });
+	      Converter conv(session.ctx(), func, session.term_cache());
+	      z3::solver solver(session.ctx());
+	      add_preconditions(conv, solver);
+	      results[i] = query_checks[i](conv, solver, stats, &runner);
+	    }
+	  catch (z3::exception& error)
+	    {
+	      if (is_timeout(error) && !runner.is_cancelled((Query)i))
+		results[i] = timed_out();
+	      else
+		exceptions[i] = std::current_exception();
+	    }
+	  catch (...)
+	    {
+	      exceptions[i] = std::current_exception();
+	    }
+	});
       }
+    for (auto& thread : threads)
+      thread.join();
   }
 
+  // A cancelled query may fail, e.g., when it is interrupted while
+  // evaluating the model, but its result is not used anyway.
+  for (int i = 0; i < nof_queries; i++)
+    {
+      if (exceptions[i] && !runner.is_cancelled((Query)i))
+	std::rethrow_exception(exceptions[i]);
+    }
+  return results;
+}
+
+// Run the queries one at a time on the same solver. The shared
+// preconditions are only added once, and each query is added within a
+// push/pop, so z3 can reuse the work done for the shared part of the
+// queries.
+Query_results run_queries_incremental(Function *func, SStats& stats,
+				      Solver_interrupt *interrupt)
+{
+  Session_ref session;
+  Converter conv(session.ctx(), func, session.term_cache());
+  z3::solver solver(session.ctx());
+  add_preconditions(conv, solver);
+
+  Query_results results;
+  Solver_interrupt::Scope scope(interrupt, [&session]() {
+    session.ctx().interrupt();
+  });
+  for (int i = 0; i < nof_queries; i++)
+    {
+      if (interrupt && interrupt->is_interrupted())
+	break;
+      solver.push();
+      results[i] = query_checks[i](conv, solver, stats, nullptr);
+      solver.pop();
+      if (results[i] && results[i]->status == Result_status::incorrect)
+	break;
+    }
+  return results;
+}
+
+// Return the queries of the solver in SMT-LIB2 format.
+std::vector<std::pair<std::string, std::string>>
+refine_queries(Function *func)
+{
+  Session_ref session;
+  Converter conv(session.ctx(), func, session.term_cache());
+
+  // The query functions return just before running the solver when the
+  // query is cancelled, so cancelling all queries makes them only build
+  // the queries.
+  Query_runner runner;
+  runner.cancel_from(0);
+
+  std::vector<std::pair<std::string, std::string>> queries;
+  for (int i = 0; i < nof_queries; i++)
+    {
+      z3::solver solver(session.ctx());
+      add_preconditions(conv, solver);
+      unsigned nof_preconditions = solver.assertions().size();
+      SStats stats;
+      query_checks[i](conv, solver, stats, &runner);
+      // Nothing is added when the query is not needed.
+      if (solver.assertions().size() > nof_preconditions)
+	queries.push_back({query_names[i], solver.to_smt2()});
+    }
+  return queries;
+}
+
+} // end anonymous namespace
+
+std::pair<SStats, Solver_result>
+check_refine_z3(Function *func, Solver_interrupt *interrupt)
+{
+  assert(func->bbs.size() == 1);
+
+  set_solver_limits();
+
+  SStats stats;
+  stats.skipped = false;
+
+  Query_results results;
+  try
+    {
+      if (config.incremental)
+	results = run_queries_incremental(func, stats, interrupt);
+      else
+	results = run_queries_parallel(func, stats, interrupt);
+    }
+  catch (z3::exception& error)
+    {
+      if (!is_timeout(error))
+	throw;
+      results = {};
+      results[0] = timed_out();
+    }
+  if (interrupt && interrupt->is_interrupted())
+    {
+      Solver_result result = {Result_status::unknown, "Analysis interrupted\n"};
+      return std::pair<SStats, Solver_result>(stats, result);
+    }
+
+  // Report the result of the highest priority query that found the
+  // transformation to be incorrect. The UB check is last, as UB that
+  // does not change the result has low priority.
+  std::string warning;
+  for (int i = 0; i < nof_queries; i++)
+    {
+      if (!results[i])
+	continue;
+      Solver_result& solver_result = *results[i];
+      if (solver_result.status == Result_status::incorrect)
+	{
+	  // The lower priority queries are not part of the result.
+	  for (int j = i + 1; j < nof_queries; j++)
+	    stats.time[j] = 0;
+	  return std::pair<SStats, Solver_result>(stats, solver_result);
+	}
+      if (solver_result.status == Result_status::unknown)
+	{
+	  assert(solver_result.message);
+	  warning = warning + *solver_result.message;
+	}
+    }
+
   if (!warning.empty())
     {
       Solver_result result = {Result_status::unknown, warning};
@@ -1029,53 +1561,174 @@ std::pair<SStats, Solver_result> check_refine_z3(Function *func)
   return std::pair<SStats, Solver_result>(stats, {Result_status::correct, {}});
 }
 
-std::pair<SStats, Solver_result> check_ub_z3(Function *func)
+std::pair<SStats, Solver_result>
+check_ub_z3(Function *func, Solver_interrupt *interrupt)
 {
   assert(func->bbs.size() == 1);
 
-  z3::context ctx;
   set_solver_limits();
+  Session_ref session;
+  z3::context& ctx = session.ctx();
 
   SStats stats;
   stats.skipped = false;
 
-  Converter conv(ctx, func);
-  z3::expr src_unique_ub_expr = conv.inst_as_bool(conv.src_unique_ub);
-  z3::expr src_common_ub_expr = conv.inst_as_bool(conv.src_common_ub);
-
+  Solver_interrupt::Scope scope(interrupt, [&ctx]() {
+    ctx.interrupt();
+  });
   z3::solver solver(ctx);
-  solver.add(src_common_ub_expr || src_unique_ub_expr);
+  try
+    {
+      Converter conv(ctx, func, session.term_cache());
+      add_ub_query(conv, solver);
+    }
+  catch (z3::exception& error)
+    {
+      if (!is_timeout(error))
+	throw;
+      if (!interrupt || !interrupt->is_interrupted())
+	return std::pair<SStats, Solver_result>(stats, timed_out());
+    }
+  if (interrupt && interrupt->is_interrupted())
+    {
+      Solver_result result = {Result_status::unknown, "Analysis interrupted\n"};
+      return std::pair<SStats, Solver_result>(stats, result);
+    }
   uint64_t start_time = get_time();
   Solver_result solver_result = run_solver(solver, "UB");
   stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
   return std::pair<SStats, Solver_result>(stats, solver_result);
 }
 
-std::pair<SStats, Solver_result> check_assert_z3(Function *func)
+std::pair<SStats, Solver_result>
+check_assert_z3(Function *func, Solver_interrupt *interrupt)
 {
   assert(func->bbs.size() == 1);
 
-  z3::context ctx;
   set_solver_limits();
+  Session_ref session;
+  z3::context& ctx = session.ctx();
 
   SStats stats;
   stats.skipped = false;
 
-  Converter conv(ctx, func);
-  z3::expr src_unique_ub_expr = conv.inst_as_bool(conv.src_unique_ub);
-  z3::expr src_common_ub_expr = conv.inst_as_bool(conv.src_common_ub);
-  z3::expr assert_expr = conv.inst_as_bool(conv.src_assert);
-
+  Solver_interrupt::Scope scope(interrupt, [&ctx]() {
+    ctx.interrupt();
+  });
   z3::solver solver(ctx);
-  solver.add(!src_common_ub_expr);
-  solver.add(!src_unique_ub_expr);
-  solver.add(assert_expr);
+  try
+    {
+      Converter conv(ctx, func, session.term_cache());
+      add_assert_query(conv, solver);
+    }
+  catch (z3::exception& error)
+    {
+      if (!is_timeout(error))
+	throw;
+      if (!interrupt || !interrupt->is_interrupted())
+	return std::pair<SStats, Solver_result>(stats, timed_out());
+    }
+  if (interrupt && interrupt->is_interrupted())
+    {
+      Solver_result result = {Result_status::unknown, "Analysis interrupted\n"};
+      return std::pair<SStats, Solver_result>(stats, result);
+    }
   uint64_t start_time = get_time();
   Solver_result solver_result = run_solver(solver, "ASSERT");
   stats.time[2] = std::max(get_time() - start_time, (uint64_t)1);
   return std::pair<SStats, Solver_result>(stats, solver_result);
 }
 
+// Check if the instructions in each pair have the same value for all
+// values of the parameters and the initial memory. A pair is reported
+// as not equal if the solver does not prove it within the resource limit
+// rlimit. The limit, and the fresh context, make the result independent
+// of the machine load and of earlier queries.
+std::vector<bool>
+check_equal_z3(Function *func,
+	       const std::vector<std::pair<Instruction *, Instruction *>>& pairs,
+	       unsigned rlimit)
+{
+  assert(func->bbs.size() == 1);
+
+  set_solver_limits();
+  z3::context ctx;
+
+  std::vector<bool> is_equal(pairs.size(), false);
+  try
+    {
+      Converter conv(ctx, func);
+      z3::solver solver(ctx);
+      z3::params params(ctx);
+      params.set("rlimit", rlimit);
+      solver.set(params);
+      for (size_t i = 0; i < pairs.size(); i++)
+	{
+	  auto [inst1, inst2] = pairs[i];
+	  solver.push();
+	  solver.add(conv.inst_as_bv(inst1) != conv.inst_as_bv(inst2));
+	  is_equal[i] = solver.check() == z3::unsat;
+	  solver.pop();
+	}
+    }
+  catch (z3::exception& error)
+    {
+      if (!is_timeout(error))
+	throw;
+    }
+  return is_equal;
+}
+
+// Return the queries check_*_z3 makes for func, as pairs of the query
+// name and the query in SMT-LIB2 format.
+std::vector<std::pair<std::string, std::string>>
+smt2_queries_z3(Function *func, Check_kind kind)
+{
+  assert(func->bbs.size() == 1);
+
+  if (kind == Check_kind::refine)
+    return refine_queries(func);
+
+  Session_ref session;
+  Converter conv(session.ctx(), func, session.term_cache());
+  z3::solver solver(session.ctx());
+  if (kind == Check_kind::ub)
+    {
+      add_ub_query(conv, solver);
+      return {{"ub", solver.to_smt2()}};
+    }
+  add_assert_query(conv, solver);
+  return {{"assert", solver.to_smt2()}};
+}
+
+// Solve a query in SMT-LIB2 format. The status is correct if the query
+// is unsat, and incorrect if it is sat.
+Solver_result solve_smt2_z3(const std::string& smt2)
+{
+  set_solver_limits();
+  z3::context ctx;
+  z3::solver solver(ctx);
+  try
+    {
+      solver.from_string(smt2.c_str());
+    }
+  catch (z3::exception& error)
+    {
+      throw Parse_error(error.msg(), 0);
+    }
+
+  switch (solver.check()) {
+  case z3::unsat:
+    return {Result_status::correct, {}};
+  case z3::sat:
+    return {Result_status::incorrect, {}};
+  case z3::unknown:
+    return {Result_status::unknown, solver.reason_unknown() + "\n"};
+  }
+
+  throw Not_implemented("solve_smt2_z3: unknown solver.check return");
+}
+
 } // end namespace smtgcc
 
 #else
@@ -1084,7 +1737,39 @@ std::pair<SStats, Solver_result> check_assert_z3(Function *func)
 
 namespace smtgcc {
 
-SStats verify_z3(Function *, Function *)
+std::pair<SStats, Solver_result>
+check_refine_z3(Function *, Solver_interrupt *)
+{
+  throw Not_implemented("z3 is not available");
+}
+
+std::pair<SStats, Solver_result>
+check_ub_z3(Function *, Solver_interrupt *)
+{
+  throw Not_implemented("z3 is not available");
+}
+
+std::pair<SStats, Solver_result>
+check_assert_z3(Function *, Solver_interrupt *)
+{
+  throw Not_implemented("z3 is not available");
+}
+
+std::vector<bool>
+check_equal_z3(Function *,
+	       const std::vector<std::pair<Instruction *, Instruction *>>&,
+	       unsigned)
+{
+  throw Not_implemented("z3 is not available");
+}
+
+std::vector<std::pair<std::string, std::string>>
+smt2_queries_z3(Function *, Check_kind)
+{
+  throw Not_implemented("z3 is not available");
+}
+
+Solver_result solve_smt2_z3(const std::string&)
 {
   throw Not_implemented("z3 is not available");
 }
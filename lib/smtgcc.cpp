@@ -2,6 +2,7 @@
 #include <cassert>
 #include <cinttypes>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <set>
 #include <sys/time.h>
@@ -12,7 +13,7 @@ using namespace std::string_literals;
 
 namespace smtgcc {
 
-const std::array<Instruction_info, 101> inst_info{{
+const std::array<Instruction_info, 102> inst_info{{
   // Integer Comparison
   {"eq", Op::EQ, Inst_class::icomparison, true, true},
   {"ne", Op::NE, Inst_class::icomparison, true, true},
@@ -41,6 +42,7 @@ const std::array<Instruction_info, 101> inst_info{{
 
   // Integer unary
   {"assert", Op::ASSERT, Inst_class::iunary, false, false},
+  {"check_mem_id", Op::CHECK_MEM_ID, Inst_class::iunary, false, false},
   {"free", Op::FREE, Inst_class::iunary, false, false},
   {"get_mem_flag", Op::GET_MEM_FLAG, Inst_class::iunary, true, false},
   {"get_mem_size", Op::GET_MEM_SIZE, Inst_class::iunary, true, false},
@@ -158,6 +160,21 @@ Config::Config()
   if (p)
     verbose = atoi(p);
 
+  solver = Solver_mode::z3;
+  p = getenv("SMTGCC_SOLVER");
+  if (p)
+    {
+      if (!strcmp(p, "cvc5"))
+	solver = Solver_mode::cvc5;
+      else if (!strcmp(p, "portfolio"))
+	solver = Solver_mode::portfolio;
+    }
+
+  incremental = false;
+  p = getenv("SMTGCC_INCREMENTAL");
+  if (p)
+    incremental = atoi(p) != 0;
+
   timeout = 120000;
   p = getenv("SMTGCC_TIMEOUT");
   if (p)
@@ -167,13 +184,97 @@ Config::Config()
   p = getenv("SMTGCC_MEMORY_LIMIT");
   if (p)
     memory_limit = atoi(p);
+
+  p = getenv("SMTGCC_CACHE_DIR");
+  if (p)
+    cache_dir = p;
+
+  cache_size = 1024;
+  p = getenv("SMTGCC_CACHE_SIZE");
+  if (p)
+    cache_size = atoi(p);
+
+  random_inputs = 256;
+  p = getenv("SMTGCC_RANDOM_INPUTS");
+  if (p)
+    random_inputs = atoi(p);
+
+  sweep = true;
+  p = getenv("SMTGCC_SWEEP");
+  if (p)
+    sweep = atoi(p) != 0;
+
+  p = getenv("SMTGCC_DUMP_QUERIES");
+  if (p)
+    dump_dir = p;
+
+  workers = 0;
+  p = getenv("SMTGCC_WORKERS");
+  if (p)
+    workers = atoi(p);
+
+  async_jobs = 0;
+  p = getenv("SMTGCC_ASYNC_JOBS");
+  if (p)
+    async_jobs = atoi(p);
+
+  async_memory_limit = 1024;
+  p = getenv("SMTGCC_ASYNC_MEMORY_LIMIT");
+  if (p)
+    async_memory_limit = atoi(p);
 }
 
 Config config;
 
-Instruction *create_inst(Op opcode)
+namespace {
+
+Module *inst_module(const Instruction *inst)
+{
+  assert(inst->bb);
+  return inst->bb->func->module;
+}
+
+Instruction *alloc_inst(Module *module)
 {
-  Instruction *inst = new Instruction;
+  void *p = module->arena.allocate(sizeof(Instruction), alignof(Instruction));
+  Instruction *inst = new (p) Instruction(&module->arena);
+  inst->id = module->next_inst_id++;
+  return inst;
+}
+
+void free_inst(Module *module, Instruction *inst)
+{
+  inst->~Instruction();
+  module->arena.deallocate(inst, sizeof(Instruction), alignof(Instruction));
+}
+
+void free_bb(Module *module, Basic_block *bb)
+{
+  bb->~Basic_block();
+  module->arena.deallocate(bb, sizeof(Basic_block), alignof(Basic_block));
+}
+
+// Return the value instructions of the function sorted after their values.
+std::vector<Instruction *> sorted_value_insts(const Function *func)
+{
+  std::vector<Instruction *> value_insts;
+  value_insts.reserve(func->values.size());
+  for (auto [_, inst] : func->values)
+    value_insts.push_back(inst);
+  std::sort(value_insts.begin(), value_insts.end(),
+	    [](const Instruction *a, const Instruction *b) {
+	      if (a->bitsize != b->bitsize)
+		return a->bitsize < b->bitsize;
+	      return a->u.value.value < b->u.value.value;
+	    });
+  return value_insts;
+}
+
+} // end anonymous namespace
+
+Instruction *create_inst(Module *module, Op opcode)
+{
+  Instruction *inst = alloc_inst(module);
   inst->opcode = opcode;
   inst->nof_args = 0;
   inst->bitsize = 0;
@@ -182,7 +283,7 @@ Instruction *create_inst(Op opcode)
 
 Instruction *create_inst(Op opcode, Instruction *arg)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(inst_module(arg));
   inst->opcode = opcode;
   inst->nof_args = 1;
   inst->arguments[0] = arg;
@@ -207,15 +308,110 @@ Instruction *create_inst(Op opcode, Instruction *arg)
   return inst;
 }
 
-Instruction::Instruction()
+Use_list::Use_list(std::pmr::memory_resource *resource)
+  : users{inline_users}
+  , resource{resource}
+{
+}
+
+Use_list::~Use_list()
+{
+  clear();
+}
+
+uint32_t Use_list::find(Instruction *inst) const
+{
+  if (index)
+    {
+      auto I = index->find(inst);
+      return I != index->end() ? I->second : nof_users;
+    }
+  uint32_t i = 0;
+  while (i < nof_users && users[i] != inst)
+    i++;
+  return i;
+}
+
+bool Use_list::contains(Instruction *inst) const
+{
+  return find(inst) != nof_users;
+}
+
+void Use_list::grow()
+{
+  uint32_t new_capacity = 2 * capacity;
+  Instruction **new_users = static_cast<Instruction **>(
+    resource->allocate(new_capacity * sizeof(Instruction *),
+		       alignof(Instruction *)));
+  std::copy(users, users + nof_users, new_users);
+  if (users != inline_users)
+    resource->deallocate(users, capacity * sizeof(Instruction *),
+			 alignof(Instruction *));
+  users = new_users;
+  capacity = new_capacity;
+}
+
+void Use_list::insert(Instruction *inst)
+{
+  if (contains(inst))
+    return;
+  if (nof_users == capacity)
+    grow();
+  if (index)
+    index->insert({inst, nof_users});
+  users[nof_users++] = inst;
+
+  if (!index && nof_users > index_threshold)
+    {
+      void *p = resource->allocate(sizeof(Index), alignof(Index));
+      index = new (p) Index(resource);
+      for (uint32_t i = 0; i < nof_users; i++)
+	index->insert({users[i], i});
+    }
+}
+
+void Use_list::erase(Instruction *inst)
+{
+  uint32_t i = find(inst);
+  if (i == nof_users)
+    return;
+  Instruction *last = users[--nof_users];
+  users[i] = last;
+  if (index)
+    {
+      index->erase(inst);
+      if (last != inst)
+	index->at(last) = i;
+    }
+}
+
+void Use_list::clear()
+{
+  if (index)
+    {
+      index->~Index();
+      resource->deallocate(index, sizeof(Index), alignof(Index));
+      index = nullptr;
+    }
+  if (users != inline_users)
+    {
+      resource->deallocate(users, capacity * sizeof(Instruction *),
+			   alignof(Instruction *));
+      users = inline_users;
+      capacity = nof_inline_users;
+    }
+  nof_users = 0;
+}
+
+Instruction::Instruction(std::pmr::memory_resource *resource)
+  : used_by(resource)
+  , phi_args(resource)
 {
-  static uint32_t next_id = 0;
-  id = next_id++;
 }
 
 Instruction *create_inst(Op opcode, Instruction *arg1, Instruction *arg2)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(inst_module(arg1));
   inst->opcode = opcode;
   inst->nof_args = 2;
   inst->arguments[0] = arg1;
@@ -281,7 +477,7 @@ Instruction *create_inst(Op opcode, Instruction *arg1, Instruction *arg2)
 
 Instruction *create_inst(Op opcode, Instruction *arg1, Instruction *arg2, Instruction *arg3)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(inst_module(arg1));
   inst->opcode = opcode;
   inst->nof_args = 3;
   inst->arguments[0] = arg1;
@@ -323,15 +519,15 @@ Instruction *create_inst(Op opcode, Instruction *arg1, Instruction *arg2, Instru
 
 Instruction *create_br_inst(Basic_block *dest_bb)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(dest_bb->func->module);
   inst->opcode = Op::BR;
   inst->u.br1.dest_bb = dest_bb;
   return inst;
 }
 
-Instruction *create_phi_inst(int bitsize)
+Instruction *create_phi_inst(Module *module, int bitsize)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(module);
   inst->opcode = Op::PHI;
   inst->bitsize = bitsize;
   return inst;
@@ -431,9 +627,9 @@ void Instruction::print(FILE *stream) const
   fprintf(stream, "\n");
 }
 
-Instruction *create_ret_inst()
+Instruction *create_ret_inst(Module *module)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(module);
   inst->opcode = Op::RET;
   inst->bitsize = 0;
   return inst;
@@ -441,7 +637,7 @@ Instruction *create_ret_inst()
 
 Instruction *create_ret_inst(Instruction *arg)
 {
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(inst_module(arg));
   inst->opcode = Op::RET;
   inst->nof_args = 1;
   inst->arguments[0] = arg;
@@ -452,7 +648,7 @@ Instruction *create_ret_inst(Instruction *arg)
 Instruction *create_ret_inst(Instruction *arg1, Instruction *arg2)
 {
   assert(arg1->bitsize == arg2->bitsize);
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(inst_module(arg1));
   inst->opcode = Op::RET;
   inst->nof_args = 2;
   inst->arguments[0] = arg1;
@@ -464,7 +660,7 @@ Instruction *create_ret_inst(Instruction *arg1, Instruction *arg2)
 Instruction *create_br_inst(Instruction *cond, Basic_block *true_bb, Basic_block *false_bb)
 {
   assert(true_bb != false_bb);
-  Instruction *inst = new Instruction;
+  Instruction *inst = alloc_inst(true_bb->func->module);
   inst->opcode = Op::BR;
   inst->nof_args = 1;
   inst->arguments[0] = cond;
@@ -538,7 +734,7 @@ void Instruction::move_before(Instruction *inst)
   if (this->prev)
     this->prev->next = this->next;
   if (this->next)
-    inst->next->prev = this->prev;
+    this->next->prev = this->prev;
   next = nullptr;
   prev = nullptr;
   bb = nullptr;
@@ -566,9 +762,8 @@ void Instruction::replace_use_with(Instruction *use, Instruction *new_inst)
     }
   new_inst->used_by.insert(use);
 
-  auto I = std::find(used_by.begin(), used_by.end(), use);
-  assert(I != used_by.end());
-  used_by.erase(I);
+  assert(used_by.contains(use));
+  used_by.erase(use);
 }
 
 void Instruction::replace_all_uses_with(Instruction *inst)
@@ -616,6 +811,7 @@ void Basic_block::insert_last(Instruction *inst)
 	     (last_inst->opcode != Op::BR
 	      && last_inst->opcode != Op::RET));
       assert(succs.empty());
+      func->rpo_cache_valid = false;
       if (inst->nof_args == 0)
 	{
 	  inst->u.br1.dest_bb->preds.push_back(this);
@@ -665,7 +861,7 @@ void Basic_block::insert_phi(Instruction *inst)
 
 Instruction *Basic_block::build_inst(Op opcode)
 {
-  Instruction *inst = create_inst(opcode);
+  Instruction *inst = create_inst(func->module, opcode);
   insert_last(inst);
   return inst;
 }
@@ -693,14 +889,14 @@ Instruction *Basic_block::build_inst(Op opcode, Instruction *arg1, Instruction *
 
 Instruction *Basic_block::build_phi_inst(int bitsize)
 {
-  Instruction *inst = create_phi_inst(bitsize);
+  Instruction *inst = create_phi_inst(func->module, bitsize);
   insert_phi(inst);
   return inst;
 }
 
 Instruction *Basic_block::build_ret_inst()
 {
-  Instruction *inst = create_ret_inst();
+  Instruction *inst = create_ret_inst(func->module);
   insert_last(inst);
   return inst;
 }
@@ -793,6 +989,13 @@ Instruction *Basic_block::build_trunc(Instruction *arg, uint32_t nof_bits)
   return build_inst(Op::EXTRACT, arg, high, low);
 }
 
+Basic_block::Basic_block(std::pmr::memory_resource *resource)
+  : phis(resource)
+  , preds(resource)
+  , succs(resource)
+{
+}
+
 void Basic_block::print(FILE *stream) const
 {
   fprintf(stream, ".%d:\n", id);
@@ -808,10 +1011,12 @@ void Basic_block::print(FILE *stream) const
 
 Basic_block *Function::build_bb()
 {
-  Basic_block *bb = new Basic_block;
+  void *p = module->arena.allocate(sizeof(Basic_block), alignof(Basic_block));
+  Basic_block *bb = new (p) Basic_block(&module->arena);
   bb->func = this;
   bb->id = next_bb_id++;
   bbs.push_back(bb);
+  rpo_cache_valid = false;
   return bb;
 }
 
@@ -846,37 +1051,23 @@ Instruction *Function::value_inst(unsigned __int128 value, uint32_t bitsize)
       return res;
     }
 
-  Instruction *new_inst = new Instruction;
+  Instruction *new_inst = alloc_inst(module);
   new_inst->opcode = Op::VALUE;
   new_inst->u.value.value = value;
   new_inst->bitsize = bitsize;
 
   // We must insert the value instructions early in the basic block as they
-  // may be used by e.g. memory initialization in the entry block.
-  // We also want a consistent order (to make functional identical code
-  // identical in the IR, even if there are minor differences in the order
-  // that the constants has been created. This happens, for example, in the
-  // GCC cpp pass when moving constants into phi-nodes.)
-  // So we insert the value instructions at the top of the entry block,
-  // sorted after their values.
-  auto [it2, _] = values.insert({std::pair(bitsize, value), new_inst});
-  if (values.size() == 1)
-    {
-      if (bbs[0]->first_inst)
-	new_inst->insert_before(bbs[0]->first_inst);
-      else
-	bbs[0]->insert_last(new_inst);
-    }
-  else if (it2 == values.begin())
-    {
-      Instruction *first_value_inst = (++it2)->second;
-      new_inst->insert_before(first_value_inst);
-    }
+  // may be used by e.g. memory initialization in the entry block. So we
+  // insert them at the top of the entry block, after the previously
+  // created value instructions. canonicalize sorts them after their values.
+  values.insert({key, new_inst});
+  if (last_value_inst)
+    new_inst->insert_after(last_value_inst);
+  else if (bbs[0]->first_inst)
+    new_inst->insert_before(bbs[0]->first_inst);
   else
-    {
-      Instruction *prev_value_inst = (--it2)->second;
-      new_inst->insert_after(prev_value_inst);
-    }
+    bbs[0]->insert_last(new_inst);
+  last_value_inst = new_inst;
   return new_inst;
 }
 
@@ -887,6 +1078,22 @@ void Function::rename(const std::string& str)
 
 void Function::canonicalize()
 {
+  // We want a consistent order of the value instructions (to make
+  // functional identical code identical in the IR, even if there are minor
+  // differences in the order that the constants has been created. This
+  // happens, for example, in the GCC cpp pass when moving constants into
+  // phi-nodes.) So we place them at the top of the entry block, sorted
+  // after their values.
+  std::vector<Instruction *> value_insts = sorted_value_insts(this);
+  for (auto it = value_insts.rbegin(); it != value_insts.rend(); it++)
+    {
+      Instruction *inst = *it;
+      if (inst != bbs[0]->first_inst)
+	inst->move_before(bbs[0]->first_inst);
+    }
+  if (!value_insts.empty())
+    last_value_inst = value_insts.back();
+
   reset_ir_id();
 
   for (Basic_block *bb : bbs)
@@ -923,14 +1130,97 @@ void Function::reset_ir_id()
 	  inst->id = inst_nbr++;
 	}
     }
+  module->next_inst_id = std::max(module->next_inst_id, inst_nbr);
+}
+
+unsigned __int128 Function::structural_hash() const
+{
+  Hasher hasher;
+  hasher.add(module->ptr_bits);
+  hasher.add(module->ptr_id_bits);
+  hasher.add(module->ptr_offset_bits);
+
+  // Number the BBs and instructions in the order canonicalize would
+  // place them, and hash the instructions using these numbers instead of
+  // the IDs.
+  Bb_map<uint32_t> bb2nbr;
+  bb2nbr.reserve(bbs.size());
+  for (size_t i = 0; i < bbs.size(); i++)
+    bb2nbr[bbs[i]] = i;
+  Inst_map<uint32_t> inst2nbr;
+  uint32_t inst_nbr = 0;
+
+  hasher.add(bbs.size());
+  for (auto inst : sorted_value_insts(this))
+    {
+      inst2nbr[inst] = inst_nbr++;
+      hasher.add(inst->bitsize);
+      hasher.add(inst->u.value.value);
+      hasher.add(inst->u.value.value >> 64);
+    }
+  for (auto bb : bbs)
+    {
+      hasher.add(bb->phis.size());
+      for (auto phi : bb->phis)
+	{
+	  inst2nbr[phi] = inst_nbr++;
+	  hasher.add(phi->bitsize);
+	}
+      for (Instruction *inst = bb->first_inst; inst; inst = inst->next)
+	{
+	  if (inst->opcode == Op::VALUE)
+	    continue;
+	  inst2nbr[inst] = inst_nbr++;
+	  hasher.add((uint64_t)inst->opcode << 32 | inst->nof_args);
+	  hasher.add(inst->bitsize);
+	  for (uint16_t i = 0; i < inst->nof_args; i++)
+	    hasher.add(inst2nbr.at(inst->arguments[i]));
+	  if (inst->opcode == Op::BR)
+	    {
+	      if (inst->nof_args == 0)
+		hasher.add(bb2nbr.at(inst->u.br1.dest_bb));
+	      else
+		{
+		  hasher.add(bb2nbr.at(inst->u.br3.true_bb));
+		  hasher.add(bb2nbr.at(inst->u.br3.false_bb));
+		}
+	    }
+	}
+    }
+
+  // The phi arguments are hashed last as they may refer to instructions
+  // in later BBs. They are hashed in the order of their BBs, as
+  // canonicalize sorts them.
+  std::vector<std::pair<uint32_t, uint32_t>> phi_args;
+  for (auto bb : bbs)
+    {
+      for (auto phi : bb->phis)
+	{
+	  phi_args.clear();
+	  for (auto [arg_inst, arg_bb] : phi->phi_args)
+	    phi_args.push_back({bb2nbr.at(arg_bb), inst2nbr.at(arg_inst)});
+	  std::sort(phi_args.begin(), phi_args.end());
+	  hasher.add(phi_args.size());
+	  for (auto [bb_nbr, arg_nbr] : phi_args)
+	    hasher.add((uint64_t)bb_nbr << 32 | arg_nbr);
+	}
+    }
+
+  return hasher.get();
 }
 
 Function *Function::clone(Module *dest_module)
 {
   Function *tgt_func = dest_module->build_function(name);
 
-  std::map<Basic_block*, Basic_block*> src2tgt_bb;
-  std::map<Instruction*, Instruction*> src2tgt_inst;
+  // The source is valid IR, so the instructions are copied directly
+  // instead of being created by the build_inst functions. The BB order
+  // is kept, so the CFG analyses can be copied instead of recomputed.
+  Bb_map<Basic_block *> src2tgt_bb;
+  Inst_map<Instruction *> src2tgt_inst;
+  src2tgt_bb.reserve(bbs.size());
+  src2tgt_inst.reserve(module->next_inst_id);
+  tgt_func->bbs.reserve(bbs.size());
   for (auto src_bb : bbs)
     {
       src2tgt_bb[src_bb] = tgt_func->build_bb();
@@ -939,6 +1229,7 @@ Function *Function::clone(Module *dest_module)
   for (auto src_bb : bbs)
     {
       Basic_block *tgt_bb = src2tgt_bb.at(src_bb);
+      tgt_bb->phis.reserve(src_bb->phis.size());
       for (auto src_phi : src_bb->phis)
 	{
 	  src2tgt_inst[src_phi] = tgt_bb->build_phi_inst(src_phi->bitsize);
@@ -947,103 +1238,46 @@ Function *Function::clone(Module *dest_module)
 	   src_inst;
 	   src_inst = src_inst->next)
 	{
-	  Instruction *tgt_inst = nullptr;
-	  Inst_class iclass = src_inst->iclass();
-	  switch (iclass)
+	  Instruction *tgt_inst = alloc_inst(dest_module);
+	  tgt_inst->opcode = src_inst->opcode;
+	  tgt_inst->bitsize = src_inst->bitsize;
+	  tgt_inst->nof_args = src_inst->nof_args;
+	  for (uint16_t i = 0; i < src_inst->nof_args; i++)
 	    {
-	    case Inst_class::nullary:
-	      tgt_inst = tgt_bb->build_inst(src_inst->opcode);
-	      break;
-	    case Inst_class::iunary:
-	    case Inst_class::funary:
-	      {
-		Instruction *arg = src2tgt_inst.at(src_inst->arguments[0]);
-		tgt_inst = tgt_bb->build_inst(src_inst->opcode, arg);
-	      }
-	      break;
-	    case Inst_class::icomparison:
-	    case Inst_class::fcomparison:
-	    case Inst_class::ibinary:
-	    case Inst_class::fbinary:
-	    case Inst_class::conv:
-	      {
-		Instruction *arg1 = src2tgt_inst.at(src_inst->arguments[0]);
-		Instruction *arg2 = src2tgt_inst.at(src_inst->arguments[1]);
-		tgt_inst = tgt_bb->build_inst(src_inst->opcode, arg1, arg2);
-	      }
-	      break;
-	    case Inst_class::ternary:
-	      {
-		Instruction *arg1 = src2tgt_inst.at(src_inst->arguments[0]);
-		Instruction *arg2 = src2tgt_inst.at(src_inst->arguments[1]);
-		Instruction *arg3 = src2tgt_inst.at(src_inst->arguments[2]);
-		tgt_inst =
-		  tgt_bb->build_inst(src_inst->opcode, arg1, arg2, arg3);
-	      }
-	      break;
-	    case Inst_class::special:
-	      if (src_inst->opcode == Op::BR)
-		{
-		  if (src_inst->nof_args == 0)
-		    {
-		      Basic_block *dest_bb =
-			src2tgt_bb.at(src_inst->u.br1.dest_bb);
-		      tgt_inst = tgt_bb->build_br_inst(dest_bb);
-		    }
-		  else
-		    {
-		      assert(src_inst->nof_args == 1);
-		      Instruction *arg1 =
-			src2tgt_inst.at(src_inst->arguments[0]);
-		      Basic_block *true_bb =
-			src2tgt_bb.at(src_inst->u.br3.true_bb);
-		      Basic_block *false_bb =
-			src2tgt_bb.at(src_inst->u.br3.false_bb);
-		      tgt_inst = tgt_bb->build_br_inst(arg1, true_bb, false_bb);
-		    }
-		}
-	      else if (src_inst->opcode == Op::RET)
-		{
-		  if (src_inst->nof_args == 0)
-		    {
-		      tgt_inst = tgt_bb->build_ret_inst();
-		    }
-		  else if (src_inst->nof_args == 1)
-		    {
-		      Instruction *arg1 =
-			src2tgt_inst.at(src_inst->arguments[0]);
-		      tgt_inst = tgt_bb->build_ret_inst(arg1);
-		    }
-		  else
-		    {
-		      assert(src_inst->nof_args == 2);
-		      Instruction *arg1 =
-			src2tgt_inst.at(src_inst->arguments[0]);
-		      Instruction *arg2 =
-			src2tgt_inst.at(src_inst->arguments[1]);
-		      tgt_inst = tgt_bb->build_ret_inst(arg1, arg2);
-		    }
-		}
-	      else if (src_inst->opcode == Op::VALUE)
+	      tgt_inst->arguments[i] = src2tgt_inst.at(src_inst->arguments[i]);
+	    }
+	  if (src_inst->opcode == Op::BR)
+	    {
+	      if (src_inst->nof_args == 0)
+		tgt_inst->u.br1.dest_bb = src2tgt_bb.at(src_inst->u.br1.dest_bb);
+	      else
 		{
-		  tgt_inst = tgt_bb->value_inst(src_inst->value(),
-						src_inst->bitsize);
+		  tgt_inst->u.br3.true_bb =
+		    src2tgt_bb.at(src_inst->u.br3.true_bb);
+		  tgt_inst->u.br3.false_bb =
+		    src2tgt_bb.at(src_inst->u.br3.false_bb);
 		}
-	      else
-		throw Not_implemented("Module::clone: "s + src_inst->name());
-	      break;
-	    default:
-	      throw Not_implemented("Module::clone: "s + src_inst->name());
 	    }
-	  assert(tgt_inst);
+	  else if (src_inst->opcode == Op::VALUE)
+	    {
+	      tgt_inst->u.value.value = src_inst->u.value.value;
+	      auto key = std::pair(src_inst->bitsize, src_inst->u.value.value);
+	      tgt_func->values.insert({key, tgt_inst});
+	    }
+	  tgt_bb->insert_last(tgt_inst);
 	  src2tgt_inst[src_inst] = tgt_inst;
 	}
     }
+  if (last_value_inst)
+    tgt_func->last_value_inst = src2tgt_inst.at(last_value_inst);
+
   for (auto src_bb : bbs)
     {
+      Basic_block *tgt_bb = src2tgt_bb.at(src_bb);
       for (auto src_phi : src_bb->phis)
 	{
 	  Instruction *tgt_phi = src2tgt_inst.at(src_phi);
+	  tgt_phi->phi_args.reserve(src_phi->phi_args.size());
 	  for (auto [src_arg_inst, src_arg_bb] : src_phi->phi_args)
 	    {
 	      Instruction *arg_inst = src2tgt_inst.at(src_arg_inst);
@@ -1051,8 +1285,24 @@ Function *Function::clone(Module *dest_module)
 	      tgt_phi->add_phi_arg(arg_inst, arg_bb);
 	    }
 	}
+
+      if (src_bb->idom)
+	tgt_bb->idom = src2tgt_bb.at(src_bb->idom);
+      if (src_bb->ipost_dom)
+	tgt_bb->ipost_dom = src2tgt_bb.at(src_bb->ipost_dom);
+      tgt_bb->dom_pre = src_bb->dom_pre;
+      tgt_bb->dom_post = src_bb->dom_post;
+      tgt_bb->post_dom_pre = src_bb->post_dom_pre;
+      tgt_bb->post_dom_post = src_bb->post_dom_post;
+    }
+
+  if (rpo_cache_valid)
+    {
+      tgt_func->rpo_cache.reserve(rpo_cache.size());
+      for (auto bb : rpo_cache)
+	tgt_func->rpo_cache.push_back(src2tgt_bb.at(bb));
+      tgt_func->rpo_cache_valid = true;
     }
-  reverse_post_order(tgt_func);
 
   return tgt_func;
 }
@@ -1111,8 +1361,11 @@ Module *create_module(uint32_t ptr_bits, uint32_t ptr_id_bits, uint32_t ptr_offs
 
 void destroy_module(struct Module *module)
 {
-  while (!module->functions.empty())
-    destroy_function(module->functions[0]);
+  // All basic blocks and instructions live in the module's arena, so there
+  // is no need to destroy them one at a time -- they are released in bulk
+  // when the arena is destroyed together with the module.
+  for (Function *func : module->functions)
+    delete func;
   delete module;
 }
 
@@ -1121,23 +1374,23 @@ void destroy_function(Function *func)
   // The functions destroying basic blocks and instructions does extra work
   // preserving function invariants (as they are meant to be used by
   // optimization passes etc.). This is not needed when destroying the
-  // function, so we'll just delete them.
+  // function, so we'll just return their memory to the arena.
+  Module *module = func->module;
   for (Basic_block *bb : func->bbs)
     {
       for (Instruction *inst : bb->phis)
-	delete inst;
+	free_inst(module, inst);
       Instruction *next_inst = bb->first_inst;
       while (next_inst)
 	{
 	  Instruction *inst = next_inst;
 	  next_inst = next_inst->next;
-	  delete inst;
+	  free_inst(module, inst);
 	}
-      delete bb;
+      free_bb(module, bb);
     }
 
   // Unlink func from module.
-  Module *module = func->module;
   auto I = std::find(module->functions.begin(), module->functions.end(), func);
   if (I != module->functions.end())
     module->functions.erase(I);
@@ -1167,15 +1420,18 @@ void destroy_basic_block(Basic_block *bb)
   auto it = std::find(bb->func->bbs.begin(), bb->func->bbs.end(), bb);
   assert(it != bb->func->bbs.end());
   bb->func->bbs.erase(it);
-  delete bb;
+  bb->func->rpo_cache_valid = false;
+  free_bb(bb->func->module, bb);
 }
 
 void destroy_instruction(Instruction *inst)
 {
   assert(inst->used_by.empty());
 
+  Module *module = nullptr;
   if (inst->bb)
     {
+      module = inst->bb->func->module;
       if (inst->opcode == Op::VALUE)
 	{
 	  auto key = std::pair(inst->bitsize, inst->value());
@@ -1215,6 +1471,7 @@ void destroy_instruction(Instruction *inst)
 		  succ->preds.erase(it);
 		}
 	      inst->bb->succs.clear();
+	      inst->bb->func->rpo_cache_valid = false;
 	      // Note: phi instructions in the successor basic blocks
 	      // will have arguments for the now removed branches.
 	      // But we cannot fix that here as the reason the branch is
@@ -1239,7 +1496,14 @@ void destroy_instruction(Instruction *inst)
 	    inst->next->prev = inst->prev;
 	}
     }
-  delete inst;
+
+  // We do not know which arena an instruction that was never inserted into
+  // a basic block was allocated from. Its storage is released when its
+  // module is destroyed.
+  if (module)
+    free_inst(module, inst);
+  else
+    inst->~Instruction();
 }
 
 uint64_t get_time()
@@ -1249,4 +1513,38 @@ uint64_t get_time()
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+void Solver_interrupt::interrupt()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  interrupted = true;
+  if (handler)
+    handler();
+}
+
+bool Solver_interrupt::is_interrupted()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return interrupted;
+}
+
+Solver_interrupt::Scope::Scope(Solver_interrupt *si,
+			       std::function<void()> handler)
+  : si{si}
+{
+  if (!si)
+    return;
+  std::lock_guard<std::mutex> lock(si->mutex);
+  si->handler = handler;
+  if (si->interrupted)
+    handler();
+}
+
+Solver_interrupt::Scope::~Scope()
+{
+  if (!si)
+    return;
+  std::lock_guard<std::mutex> lock(si->mutex);
+  si->handler = nullptr;
+}
+
 } // end namespace smtgcc
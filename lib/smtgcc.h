@@ -2,11 +2,16 @@
 #define SMTGCC_H
 
 #include <array>
+#include <cassert>
 #include <cstdint>
+#include <functional>
 #include <map>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define MEM_KEEP    1
@@ -57,6 +62,7 @@ enum class Op : uint8_t {
 
   // Integer unary
   ASSERT,
+  CHECK_MEM_ID,
   FREE,
   GET_MEM_FLAG,
   GET_MEM_SIZE,
@@ -181,7 +187,7 @@ struct Instruction_info {
   bool is_commutative;
 };
 
-extern const std::array<Instruction_info, 101> inst_info;
+extern const std::array<Instruction_info, 102> inst_info;
 
 struct Module;
 struct Function;
@@ -193,6 +199,45 @@ struct Phi_arg {
   Basic_block *bb;
 };
 
+// The set of instructions using an instruction. Each user is recorded
+// once, and iteration visits the users in the order they were added
+// (modulo removals, which move the last user into the removed slot).
+//
+// Most instructions have only a few users, which are stored inline in
+// the list. Lists with many users (typically constants) get a hash index
+// so that insert and erase stay O(1).
+class Use_list {
+public:
+  Use_list(std::pmr::memory_resource *resource);
+  Use_list(const Use_list&) = delete;
+  Use_list& operator=(const Use_list&) = delete;
+  ~Use_list();
+
+  Instruction *const *begin() const { return users; }
+  Instruction *const *end() const { return users + nof_users; }
+  bool empty() const { return nof_users == 0; }
+  size_t size() const { return nof_users; }
+  bool contains(Instruction *inst) const;
+  void insert(Instruction *inst);
+  void erase(Instruction *inst);
+  void clear();
+
+private:
+  using Index = std::pmr::unordered_map<Instruction *, uint32_t>;
+  static const uint32_t nof_inline_users = 2;
+  static const uint32_t index_threshold = 16;
+
+  uint32_t find(Instruction *inst) const;
+  void grow();
+
+  Instruction **users;
+  uint32_t nof_users = 0;
+  uint32_t capacity = nof_inline_users;
+  Instruction *inline_users[nof_inline_users];
+  std::pmr::memory_resource *resource;
+  Index *index = nullptr;
+};
+
 struct Instruction {
   uint32_t bitsize = 0;
   Op opcode;
@@ -202,8 +247,8 @@ struct Instruction {
   Instruction *prev = nullptr;
   Instruction *next = nullptr;
   uint32_t id;
-  std::set<Instruction *> used_by;
-  std::vector<Phi_arg> phi_args;
+  Use_list used_by;
+  std::pmr::vector<Phi_arg> phi_args;
 
   union {
     struct {
@@ -247,15 +292,23 @@ struct Instruction {
   void remove_phi_args();
   void print(FILE *stream) const;
 
-  Instruction();
+  Instruction(std::pmr::memory_resource *resource);
 };
 
 struct Basic_block {
-  std::vector<Instruction *> phis;
-  std::vector<Basic_block *> preds;
-  std::vector<Basic_block *> succs;
-  std::set<Basic_block *> dom;
-  std::set<Basic_block *> post_dom;
+  std::pmr::vector<Instruction *> phis;
+  std::pmr::vector<Basic_block *> preds;
+  std::pmr::vector<Basic_block *> succs;
+
+  // The dominator and post dominator trees, calculated by
+  // reverse_post_order for loop-free functions. The pre/post fields
+  // number the trees in DFS order, which makes the dominance queries O(1).
+  Basic_block *idom = nullptr;
+  Basic_block *ipost_dom = nullptr;
+  uint32_t dom_pre = 0;
+  uint32_t dom_post = 0;
+  uint32_t post_dom_pre = 0;
+  uint32_t post_dom_post = 0;
 
   Instruction *first_inst = nullptr;
   Instruction *last_inst = nullptr;
@@ -283,20 +336,68 @@ struct Basic_block {
   Instruction *value_inst(unsigned __int128 value, uint32_t bitsize);
   Instruction *value_m1_inst(uint32_t bitsize);
   void print(FILE *stream) const;
+
+  Basic_block(std::pmr::memory_resource *resource);
+};
+
+// Accumulates a 128-bit hash of a sequence of 64-bit words. This is used
+// where the hash identifies the data (e.g., for caching), so collisions
+// must be very unlikely.
+struct Hasher {
+  uint64_t h1 = 0x6a09e667f3bcc908;
+  uint64_t h2 = 0xbb67ae8584caa73b;
+
+  static uint64_t mix(uint64_t x)
+  {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+  void add(uint64_t x)
+  {
+    h1 = mix(h1 ^ x) + h2;
+    h2 = mix(h2 + x + 0x9e3779b97f4a7c15) ^ h1;
+  }
+  unsigned __int128 get() const
+  {
+    return (unsigned __int128)mix(h1 ^ h2) << 64 | mix(h2 + h1);
+  }
+};
+
+struct Value_key_hash {
+  size_t operator()(const std::pair<uint32_t, unsigned __int128>& key) const
+  {
+    uint64_t h = key.first;
+    h = (h ^ (uint64_t)key.second) * 0x9e3779b97f4a7c15;
+    h = (h ^ (uint64_t)(key.second >> 64)) * 0x9e3779b97f4a7c15;
+    return h ^ (h >> 32);
+  }
 };
 
 struct Function {
 public:
   std::string name;
   std::vector<Basic_block *> bbs;
-  std::map<std::pair<uint32_t, unsigned __int128>, Instruction *> values;
+  std::unordered_map<std::pair<uint32_t, unsigned __int128>, Instruction *,
+		     Value_key_hash> values;
   Instruction *last_value_inst = nullptr;
 
+  // Cache for rpo_bbs. It is invalidated when the CFG is modified.
+  std::vector<Basic_block *> rpo_cache;
+  bool rpo_cache_valid = false;
+
   Basic_block *build_bb();
   Instruction *value_inst(unsigned __int128 value, uint32_t bitsize);
   void rename(const std::string& str);
   void canonicalize();
   void reset_ir_id();
+
+  // A hash of the IR that ignores the function name and the instruction
+  // and BB IDs. It is computed in the order canonicalize uses, so the hash
+  // is identical for functions that print identically after canonicalize.
+  // The BBs must be in reverse post order.
+  unsigned __int128 structural_hash() const;
+
   Function *clone(Module *dest_module);
   void print(FILE *stream) const;
   Module *module;
@@ -304,6 +405,34 @@ private:
   int next_bb_id = 0;
 };
 
+// Memory resource that allocates from the default resource, and keeps
+// track of the number of bytes currently allocated.
+class Counting_resource : public std::pmr::memory_resource {
+  size_t allocated = 0;
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    void *p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    allocated += bytes;
+    return p;
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override
+  {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    allocated -= bytes;
+  }
+  bool do_is_equal(const memory_resource& other) const noexcept override
+  {
+    return this == &other;
+  }
+
+public:
+  size_t size() const
+  {
+    return allocated;
+  }
+};
+
 struct Module {
   std::vector<Function *> functions;
   Function *build_function(const std::string& name);
@@ -316,6 +445,95 @@ struct Module {
   uint32_t ptr_offset_bits;
   uint32_t ptr_offset_high;
   uint32_t ptr_offset_low;
+
+  // The memory used by the arena.
+  Counting_resource arena_memory;
+
+  // Storage for all instructions and basic blocks in the module (including
+  // their phi arguments, use lists, etc.). Everything allocated here is
+  // released in bulk by destroy_module.
+  std::pmr::unsynchronized_pool_resource arena{&arena_memory};
+
+  // Source of instruction IDs. Function::reset_ir_id renumbers the
+  // instructions of a function densely from 0, and ensures this counter
+  // stays above the IDs in use.
+  uint32_t next_inst_id = 0;
+};
+
+// Map from instructions or basic blocks to T, stored in a vector indexed
+// by the ID. This is only valid while the IDs are unique, so a map should
+// only hold keys from one function. The IDs are dense after
+// Function::reset_ir_id, which should be called first when the function
+// may have been modified a lot since it was last renumbered.
+template<typename Key, typename T>
+class Id_map {
+public:
+  bool contains(const Key *key) const
+  {
+    return (size_t)key->id < present.size() && present[key->id];
+  }
+  T& at(const Key *key)
+  {
+    assert(contains(key));
+    return values[key->id];
+  }
+  const T& at(const Key *key) const
+  {
+    assert(contains(key));
+    return values[key->id];
+  }
+  T& operator[](const Key *key)
+  {
+    if ((size_t)key->id >= present.size())
+      {
+	present.resize(key->id + 1);
+	values.resize(key->id + 1);
+      }
+    present[key->id] = true;
+    return values[key->id];
+  }
+  void insert(const Key *key, T value)
+  {
+    if (!contains(key))
+      (*this)[key] = std::move(value);
+  }
+  void erase(const Key *key)
+  {
+    if (contains(key))
+      {
+	present[key->id] = false;
+	values[key->id] = T();
+      }
+  }
+  void reserve(size_t size)
+  {
+    present.reserve(size);
+    values.reserve(size);
+  }
+  void clear()
+  {
+    present.clear();
+    values.clear();
+  }
+
+private:
+  std::vector<T> values;
+  std::vector<bool> present;
+};
+
+template<typename T>
+using Inst_map = Id_map<Instruction, T>;
+
+template<typename T>
+using Bb_map = Id_map<Basic_block, T>;
+
+enum class Solver_mode {
+  z3,
+  cvc5,
+
+  // Run both solvers in parallel, and use the result from the solver
+  // that first finds a conclusive answer.
+  portfolio
 };
 
 struct Config
@@ -323,11 +541,50 @@ struct Config
   Config();
   int verbose;
 
+  // The SMT solver(s) to use.
+  Solver_mode solver;
+
+  // Run the refinement queries one at a time using incremental solving,
+  // instead of running them in parallel.
+  bool incremental;
+
   // SMT solver timeout in ms.
   int timeout;
 
   // SMT solver memory limit in megabytes.
   int memory_limit;
+
+  // Directory for the cache of solver results. The cache is disabled if
+  // this is empty.
+  std::string cache_dir;
+
+  // Maximum size of the cache in megabytes.
+  int cache_size;
+
+  // Number of inputs the check function is evaluated on, searching for
+  // a counterexample before running the SMT solver. The evaluation is
+  // disabled if this is 0.
+  int random_inputs;
+
+  // Merge the instructions in the refinement check function that are
+  // proved to be equal, before solving the queries.
+  bool sweep;
+
+  // Directory where the solver queries are written in SMT-LIB2 format.
+  // The queries are not written if this is empty.
+  std::string dump_dir;
+
+  // Number of worker processes used for running the SMT solvers. The
+  // solvers are run in this process if this is 0.
+  int workers;
+
+  // Number of threads the smtgcc-tv plugin uses for checking functions
+  // in the background. The checks are done while compiling if this is 0.
+  int async_jobs;
+
+  // Maximum memory in megabytes used by the IR of the functions waiting
+  // to be checked in the background.
+  int async_memory_limit;
 };
 
 extern Config config;
@@ -347,13 +604,13 @@ void destroy_function(Function *);
 void destroy_basic_block(Basic_block *);
 void destroy_instruction(Instruction *);
 
-Instruction *create_inst(Op opcode);
+Instruction *create_inst(Module *module, Op opcode);
 Instruction *create_inst(Op opcode, Instruction *arg);
 Instruction *create_inst(Op opcode, Instruction *arg1, Instruction *arg2);
 Instruction *create_inst(Op opcode, Instruction *arg1, Instruction *arg2,
 			 Instruction *arg3);
-Instruction *create_phi_inst(int bitsize);
-Instruction *create_ret_inst();
+Instruction *create_phi_inst(Module *module, int bitsize);
+Instruction *create_ret_inst(Module *module);
 Instruction *create_ret_inst(Instruction *arg);
 Instruction *create_ret_inst(Instruction *arg1, Instruction *arg2);
 Instruction *create_br_inst(Basic_block *dest_bb);
@@ -371,9 +628,51 @@ struct SStats {
   bool skipped = true;
 };
 
+struct Solver_stats {
+  SStats cvc5;
+  SStats z3;
+};
+
+enum class Check_kind : uint8_t {
+  refine,
+  ub,
+  assertion
+};
+
+// Describes what is checked. This is written as metadata when the solver
+// queries are dumped.
+struct Check_origin {
+  std::string function;
+  std::string passes;
+};
+
 uint64_t get_time();
 
+// Used for interrupting a solver running in another thread, e.g. when the
+// portfolio mode has got the result from the other solver.
+class Solver_interrupt {
+  std::mutex mutex;
+  bool interrupted = false;
+  std::function<void()> handler;
+
+public:
+  void interrupt();
+  bool is_interrupted();
+
+  // Registers a function that interrupts the running solver for the
+  // lifetime of the scope. The function is called directly if the
+  // solver has already been interrupted.
+  class Scope {
+    Solver_interrupt *si;
+
+  public:
+    Scope(Solver_interrupt *si, std::function<void()> handler);
+    ~Scope();
+  };
+};
+
 // cfg.cpp
+const std::vector<Basic_block *>& rpo_bbs(Function *func);
 void reverse_post_order(Function *func);
 bool has_loops(Function *func);
 void simplify_cfg(Function *func);
@@ -383,15 +682,25 @@ bool dominates(const Basic_block *bb1, const Basic_block *bb2);
 bool post_dominates(const Basic_block *bb1, const Basic_block *bb2);
 
 // check.cpp
-Solver_result check_refine(Module *module);
-Solver_result check_assert(Function *func);
-Solver_result check_ub(Function *func);
+Solver_result check_refine(Module *module, const Check_origin& origin = {});
+Solver_result check_assert(Function *func, const Check_origin& origin = {});
+Solver_result check_ub(Function *func, const Check_origin& origin = {});
 void convert(Module *module);
+std::pair<SStats, Solver_result> run_solver(Function *func, Check_kind kind,
+					    Solver_mode solver,
+					    Solver_stats& stats,
+					    Solver_interrupt *interrupt = nullptr);
+std::optional<std::pair<uint64_t, uint64_t>>
+max_memory_object(Instruction *size_array);
 
 // dead_code_elimination.cpp
 void dead_code_elimination(Function *func);
 void dead_code_elimination(Module *module);
 
+// falsify.cpp
+std::optional<Solver_result> falsify(Function *func, Check_kind kind);
+Inst_map<uint64_t> simulate(Function *func, int nof_inputs);
+
 // loop_unroll.cpp
 bool loop_unroll(Function *func);
 bool loop_unroll(Module *module);
@@ -401,6 +710,16 @@ void canonicalize_memory(Module *module);
 void ls_elim(Function *func);
 void ls_elim(Module *module);
 
+// binary_ir.cpp
+bool is_binary_ir(std::string const& file_name);
+Module *read_binary_ir(std::string const& file_name);
+Module *read_binary_ir(const void *data, size_t size);
+void write_binary_ir(Module *module, FILE *stream);
+
+// query_dump.cpp
+void dump_queries(Function *func, Check_kind kind, const Check_origin& origin,
+		  const std::string& slice = "");
+
 // read_ir.cpp
 Module *parse_ir(std::string const& file_name);
 
@@ -411,6 +730,12 @@ struct riscv_state {
 };
 Function *parse_riscv(std::string const& file_name, riscv_state *state);
 
+// result_cache.cpp
+std::optional<std::pair<Solver_stats, Solver_result>>
+cache_lookup(unsigned __int128 key);
+void cache_insert(unsigned __int128 key, const Solver_stats& stats,
+		  const Solver_result& result);
+
 // simplify_insts.cpp
 void simplify_insts(Function *func);
 void simplify_insts(Module *module);
@@ -418,14 +743,40 @@ void simplify_mem(Function *func);
 void simplify_mem(Module *module);
 
 // smt_cvc5.cpp
-std::pair<SStats, Solver_result> check_refine_cvc5(Function *func);
-std::pair<SStats, Solver_result> check_assert_cvc5(Function *func);
-std::pair<SStats, Solver_result> check_ub_cvc5(Function *func);
+std::pair<SStats, Solver_result>
+check_refine_cvc5(Function *func, Solver_interrupt *interrupt = nullptr);
+std::pair<SStats, Solver_result>
+check_assert_cvc5(Function *func, Solver_interrupt *interrupt = nullptr);
+std::pair<SStats, Solver_result>
+check_ub_cvc5(Function *func, Solver_interrupt *interrupt = nullptr);
+Solver_result solve_smt2_cvc5(const std::string& smt2);
 
 // smt_z3.cpp
-std::pair<SStats, Solver_result> check_refine_z3(Function *func);
-std::pair<SStats, Solver_result> check_assert_z3(Function *func);
-std::pair<SStats, Solver_result> check_ub_z3(Function *func);
+std::pair<SStats, Solver_result>
+check_refine_z3(Function *func, Solver_interrupt *interrupt = nullptr);
+std::pair<SStats, Solver_result>
+check_assert_z3(Function *func, Solver_interrupt *interrupt = nullptr);
+std::pair<SStats, Solver_result>
+check_ub_z3(Function *func, Solver_interrupt *interrupt = nullptr);
+std::vector<bool>
+check_equal_z3(Function *func,
+	       const std::vector<std::pair<Instruction *, Instruction *>>& pairs,
+	       unsigned rlimit);
+std::vector<std::pair<std::string, std::string>>
+smt2_queries_z3(Function *func, Check_kind kind);
+Solver_result solve_smt2_z3(const std::string& smt2);
+
+// solver_worker.cpp
+// Start the process forking the solver workers, if config.workers > 0 or
+// cvc5 is used. This must be called before the process creates any
+// threads.
+void start_worker_server();
+std::pair<SStats, Solver_result>
+check_in_worker(Function *func, Check_kind kind, Solver_mode solver,
+		Solver_stats& stats, Solver_interrupt *interrupt = nullptr);
+
+// sweep.cpp
+bool sweep(Function *func);
 
 // validate_ir.cpp
 void validate(Module *module);
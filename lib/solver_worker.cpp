@@ -0,0 +1,613 @@
+// Running the SMT solvers in worker processes.
+//
+// The workers are forked from a server process, that is forked from the
+// process doing the checks by start_worker_server before it has created
+// any threads. Forking the workers directly from the process doing the
+// checks is not safe, as other threads may hold locks (e.g., in z3) that
+// would stay locked forever in the worker.
+//
+// Each worker runs one check at a time, using one solver. The function to
+// check is sent to the worker in the binary IR format, and the worker
+// sends back the result. The workers are reused for many checks, and a new worker is
+// started when a worker has died.
+//
+// Each worker has limits on its memory use and CPU time, and it is killed
+// if it does not reply within the time it may use for the check, so a
+// runaway or hung solver query only kills the worker. This is reported
+// as an unknown result. Killing the worker is also how a check is
+// interrupted, which is the only way to stop cvc5 while it is solving.
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "smtgcc.h"
+
+using namespace std::string_literals;
+
+namespace smtgcc {
+
+namespace {
+
+// Up to this many solver queries may run in parallel in a worker (the
+// three queries of a refinement check), so the worker's CPU time limit
+// for a check is this many times the solver timeout.
+const int max_parallel_queries = 3;
+
+// Extra CPU time, in seconds, for the work done outside the solver.
+const int cpu_time_margin = 10;
+
+enum class Response : uint8_t {
+  result,
+  not_implemented
+};
+
+enum class Server_request : uint8_t {
+  start_worker,
+  wait_worker
+};
+
+struct Worker {
+  pid_t pid;
+  int fd;
+};
+
+std::mutex pool_mutex;
+std::condition_variable pool_cv;
+std::vector<Worker *> idle_workers;
+std::vector<Worker *> all_workers;
+
+// The connection to the server forking the workers. The requests to the
+// server are serialized by server_mutex.
+std::mutex server_mutex;
+int server_fd = -1;
+
+// Wait until fd is ready for the events, or the deadline (as returned by
+// get_time) has passed. A deadline of 0 means that there is no deadline.
+bool wait_for(int fd, short events, uint64_t deadline)
+{
+  for (;;)
+    {
+      int timeout = -1;
+      if (deadline)
+	{
+	  uint64_t now = get_time();
+	  if (now >= deadline)
+	    return false;
+	  timeout = std::min<uint64_t>(deadline - now, 60000);
+	}
+      struct pollfd pfd = {fd, events, 0};
+      int n = poll(&pfd, 1, timeout);
+      if (n > 0)
+	return true;
+      if (n < 0 && errno != EINTR)
+	return false;
+    }
+}
+
+bool write_all(int fd, const void *data, size_t size, uint64_t deadline = 0)
+{
+  const char *p = (const char *)data;
+  while (size > 0)
+    {
+      if (!wait_for(fd, POLLOUT, deadline))
+	return false;
+      // MSG_NOSIGNAL makes this fail instead of raising SIGPIPE if the
+      // other process has died.
+      ssize_t n = send(fd, p, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+	continue;
+      if (n <= 0)
+	return false;
+      p += n;
+      size -= n;
+    }
+  return true;
+}
+
+bool read_all(int fd, void *data, size_t size, uint64_t deadline = 0)
+{
+  char *p = (char *)data;
+  while (size > 0)
+    {
+      if (!wait_for(fd, POLLIN, deadline))
+	return false;
+      ssize_t n = recv(fd, p, size, MSG_DONTWAIT);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+	continue;
+      if (n <= 0)
+	return false;
+      p += n;
+      size -= n;
+    }
+  return true;
+}
+
+// Messages are sent as the size followed by the data.
+bool write_message(int fd, const std::string& msg, uint64_t deadline = 0)
+{
+  uint64_t size = msg.size();
+  return write_all(fd, &size, sizeof(size), deadline)
+    && write_all(fd, msg.data(), msg.size(), deadline);
+}
+
+bool read_message(int fd, std::string& msg, uint64_t deadline = 0)
+{
+  uint64_t size;
+  if (!read_all(fd, &size, sizeof(size), deadline))
+    return false;
+  msg.resize(size);
+  return read_all(fd, msg.data(), size, deadline);
+}
+
+void add_bytes(std::string& msg, const void *data, size_t size)
+{
+  msg.append((const char *)data, size);
+}
+
+void add_stats(std::string& msg, const SStats& stats)
+{
+  add_bytes(msg, stats.time.data(), sizeof(stats.time));
+  add_bytes(msg, &stats.skipped, sizeof(stats.skipped));
+}
+
+void get_bytes(const std::string& msg, size_t& pos, void *data, size_t size)
+{
+  if (pos + size > msg.size())
+    throw Not_implemented("check_in_worker: truncated response");
+  memcpy(data, msg.data() + pos, size);
+  pos += size;
+}
+
+void get_stats(const std::string& msg, size_t& pos, SStats& stats)
+{
+  get_bytes(msg, pos, stats.time.data(), sizeof(stats.time));
+  get_bytes(msg, pos, &stats.skipped, sizeof(stats.skipped));
+}
+
+std::string get_string(const std::string& msg, size_t& pos)
+{
+  uint64_t size;
+  get_bytes(msg, pos, &size, sizeof(size));
+  if (pos + size > msg.size())
+    throw Not_implemented("check_in_worker: truncated response");
+  std::string str = msg.substr(pos, size);
+  pos += size;
+  return str;
+}
+
+void add_string(std::string& msg, const std::string& str)
+{
+  uint64_t size = str.size();
+  add_bytes(msg, &size, sizeof(size));
+  msg += str;
+}
+
+// The time, in seconds, a worker may use for one check.
+uint64_t check_budget()
+{
+  return (uint64_t)config.timeout * max_parallel_queries / 1000
+    + cpu_time_margin;
+}
+
+// Set the CPU time limit so that the worker is killed by SIGXCPU if the
+// next check uses more than its share of CPU time.
+void set_cpu_limit()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  rlim_t used = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec;
+  rlim_t budget = check_budget();
+  struct rlimit limit;
+  getrlimit(RLIMIT_CPU, &limit);
+  limit.rlim_cur = used + budget;
+  if (limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max)
+    limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_CPU, &limit);
+}
+
+// Limit the address space to the memory used when the worker starts,
+// plus config.memory_limit.
+void set_memory_limit()
+{
+  size_t vm_size = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f)
+    {
+      unsigned long pages;
+      if (fscanf(f, "%lu", &pages) == 1)
+	vm_size = pages * sysconf(_SC_PAGESIZE);
+      fclose(f);
+    }
+  struct rlimit limit;
+  limit.rlim_cur = vm_size + (rlim_t)config.memory_limit * 1024 * 1024;
+  limit.rlim_max = limit.rlim_cur;
+  setrlimit(RLIMIT_AS, &limit);
+
+  // Do not fill the disk with core files from workers that have hit
+  // their limits.
+  limit.rlim_cur = limit.rlim_max = 0;
+  setrlimit(RLIMIT_CORE, &limit);
+}
+
+std::string run_check(const std::string& request)
+{
+  std::string response;
+  Module *module = nullptr;
+  try
+    {
+      Check_kind kind;
+      Solver_mode solver;
+      uint32_t func_idx;
+      size_t pos = 0;
+      get_bytes(request, pos, &kind, sizeof(kind));
+      get_bytes(request, pos, &solver, sizeof(solver));
+      get_bytes(request, pos, &func_idx, sizeof(func_idx));
+      module = read_binary_ir(request.data() + pos, request.size() - pos);
+      if (func_idx >= module->functions.size())
+	throw Not_implemented("check_in_worker: invalid function");
+
+      Solver_stats stats;
+      auto [solver_stats, result] =
+	run_solver(module->functions[func_idx], kind, solver, stats);
+      Response kind_of_response = Response::result;
+      add_bytes(response, &kind_of_response, sizeof(kind_of_response));
+      add_stats(response, solver_stats);
+      add_stats(response, stats.cvc5);
+      add_stats(response, stats.z3);
+      add_bytes(response, &result.status, sizeof(result.status));
+      bool has_message = result.message.has_value();
+      add_bytes(response, &has_message, sizeof(has_message));
+      if (has_message)
+	add_string(response, *result.message);
+    }
+  catch (Not_implemented& error)
+    {
+      response.clear();
+      Response kind_of_response = Response::not_implemented;
+      add_bytes(response, &kind_of_response, sizeof(kind_of_response));
+      add_string(response, error.msg);
+    }
+  catch (Parse_error& error)
+    {
+      response.clear();
+      Response kind_of_response = Response::not_implemented;
+      add_bytes(response, &kind_of_response, sizeof(kind_of_response));
+      add_string(response, "check_in_worker: " + error.msg);
+    }
+  if (module)
+    destroy_module(module);
+  return response;
+}
+
+[[noreturn]] void worker_main(int fd)
+{
+  set_memory_limit();
+  for (;;)
+    {
+      std::string request;
+      if (!read_message(fd, request))
+	_exit(0);
+      set_cpu_limit();
+      std::string response = run_check(request);
+      if (!write_message(fd, response))
+	_exit(0);
+    }
+}
+
+bool send_worker(int fd, pid_t pid, int worker_fd)
+{
+  struct iovec iov = {&pid, sizeof(pid)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(struct cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+  if (worker_fd >= 0)
+    {
+      msg.msg_control = buf;
+      msg.msg_controllen = sizeof(buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &worker_fd, sizeof(int));
+    }
+  ssize_t n;
+  do
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  return n == sizeof(pid);
+}
+
+bool receive_worker(int fd, pid_t& pid, int& worker_fd)
+{
+  struct iovec iov = {&pid, sizeof(pid)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(struct cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof(buf);
+  ssize_t n;
+  do
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  while (n < 0 && errno == EINTR);
+  if (n != sizeof(pid))
+    return false;
+  worker_fd = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg
+      && cmsg->cmsg_level == SOL_SOCKET
+      && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&worker_fd, CMSG_DATA(cmsg), sizeof(int));
+  return true;
+}
+
+// The server forking the workers. It handles one request at a time:
+//  * start_worker: Fork a new worker, and send its pid and socket.
+//  * wait_worker: Wait for the worker with the given pid to exit, and
+//    send its status.
+[[noreturn]] void server_main(int fd)
+{
+  // The workers must not be reaped automatically, as their status is
+  // reported by wait_worker.
+  signal(SIGCHLD, SIG_DFL);
+
+  for (;;)
+    {
+      Server_request request;
+      if (!read_all(fd, &request, sizeof(request)))
+	_exit(0);
+      if (request == Server_request::start_worker)
+	{
+	  int fds[2];
+	  pid_t pid = -1;
+	  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)
+	    {
+	      pid = fork();
+	      if (pid == 0)
+		{
+		  close(fd);
+		  close(fds[0]);
+		  worker_main(fds[1]);
+		}
+	      close(fds[1]);
+	      if (pid < 0)
+		close(fds[0]);
+	    }
+	  bool sent = send_worker(fd, pid, pid < 0 ? -1 : fds[0]);
+	  if (pid >= 0)
+	    close(fds[0]);
+	  if (!sent)
+	    _exit(0);
+	}
+      else if (request == Server_request::wait_worker)
+	{
+	  pid_t pid;
+	  if (!read_all(fd, &pid, sizeof(pid)))
+	    _exit(0);
+	  int status;
+	  pid_t res;
+	  do
+	    res = waitpid(pid, &status, 0);
+	  while (res < 0 && errno == EINTR);
+	  bool valid = res == pid;
+	  if (!write_all(fd, &valid, sizeof(valid))
+	      || !write_all(fd, &status, sizeof(status)))
+	    _exit(0);
+	}
+      else
+	_exit(1);
+    }
+}
+
+// Start a new worker. Must be called with pool_mutex held.
+Worker *start_worker()
+{
+  std::lock_guard<std::mutex> lock(server_mutex);
+  if (server_fd < 0)
+    throw Not_implemented("check_in_worker: the worker server is not started");
+  Server_request request = Server_request::start_worker;
+  pid_t pid;
+  int fd;
+  if (!write_all(server_fd, &request, sizeof(request))
+      || !receive_worker(server_fd, pid, fd))
+    throw Not_implemented("check_in_worker: lost contact with the worker server");
+  if (pid < 0 || fd < 0)
+    throw Not_implemented("check_in_worker: could not start a worker");
+  Worker *worker = new Worker;
+  worker->pid = pid;
+  worker->fd = fd;
+  all_workers.push_back(worker);
+  return worker;
+}
+
+// Kill the worker, and return its exit status as reported by the server.
+std::optional<int> stop_worker(Worker *worker)
+{
+  kill(worker->pid, SIGKILL);
+  std::lock_guard<std::mutex> lock(server_mutex);
+  Server_request request = Server_request::wait_worker;
+  bool valid;
+  int status;
+  if (!write_all(server_fd, &request, sizeof(request))
+      || !write_all(server_fd, &worker->pid, sizeof(worker->pid))
+      || !read_all(server_fd, &valid, sizeof(valid))
+      || !read_all(server_fd, &status, sizeof(status))
+      || !valid)
+    return {};
+  return status;
+}
+
+Worker *acquire_worker()
+{
+  std::unique_lock<std::mutex> lock(pool_mutex);
+  pool_cv.wait(lock, []() {
+    // The workers that only are used for running cvc5 (when
+    // config.workers == 0) are not limited here, as the number of
+    // parallel checks is already limited by the callers.
+    return !idle_workers.empty()
+      || config.workers <= 0
+      || all_workers.size() < (size_t)config.workers;
+  });
+  if (!idle_workers.empty())
+    {
+      Worker *worker = idle_workers.back();
+      idle_workers.pop_back();
+      return worker;
+    }
+  return start_worker();
+}
+
+void release_worker(Worker *worker)
+{
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    idle_workers.push_back(worker);
+  }
+  pool_cv.notify_one();
+}
+
+// Remove a worker that has failed. Returns the reason it failed.
+std::string destroy_worker(Worker *worker, bool timed_out)
+{
+  close(worker->fd);
+  std::optional<int> status = stop_worker(worker);
+
+  std::string reason;
+  if (timed_out)
+    reason = "the solver process did not respond within its time limit";
+  else if (!status)
+    reason = "lost contact with the solver process";
+  else if (WIFSIGNALED(*status) && WTERMSIG(*status) == SIGXCPU)
+    reason = "the solver process exceeded its CPU time limit";
+  else if (WIFSIGNALED(*status) && WTERMSIG(*status) == SIGKILL)
+    reason = "the solver process was killed (out of memory?)";
+  else if (WIFSIGNALED(*status))
+    reason = "the solver process crashed ("s + strsignal(WTERMSIG(*status)) + ")";
+  else if (WIFEXITED(*status))
+    reason = "the solver process exited with status "
+      + std::to_string(WEXITSTATUS(*status));
+  else
+    reason = "the solver process failed";
+
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    std::erase(all_workers, worker);
+  }
+  pool_cv.notify_one();
+  delete worker;
+  return reason;
+}
+
+} // end anonymous namespace
+
+void start_worker_server()
+{
+  if ((config.workers <= 0 && config.solver == Solver_mode::z3)
+      || server_fd >= 0)
+    return;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    return;
+  pid_t pid = fork();
+  if (pid < 0)
+    {
+      close(fds[0]);
+      close(fds[1]);
+      return;
+    }
+  if (pid == 0)
+    {
+      close(fds[0]);
+      server_main(fds[1]);
+    }
+  close(fds[1]);
+  server_fd = fds[0];
+}
+
+std::pair<SStats, Solver_result>
+check_in_worker(Function *func, Check_kind kind, Solver_mode solver,
+		Solver_stats& stats, Solver_interrupt *interrupt)
+{
+  Module *module = func->module;
+  uint32_t func_idx = 0;
+  while (module->functions[func_idx] != func)
+    func_idx++;
+
+  std::string request;
+  add_bytes(request, &kind, sizeof(kind));
+  add_bytes(request, &solver, sizeof(solver));
+  add_bytes(request, &func_idx, sizeof(func_idx));
+  char *buf = nullptr;
+  size_t buf_size = 0;
+  FILE *stream = open_memstream(&buf, &buf_size);
+  if (!stream)
+    throw Not_implemented("check_in_worker: open_memstream failed");
+  write_binary_ir(module, stream);
+  fclose(stream);
+  add_bytes(request, buf, buf_size);
+  free(buf);
+
+  Worker *worker = acquire_worker();
+  std::string response;
+  bool failed;
+  uint64_t deadline = get_time() + check_budget() * 1000;
+  {
+    // An interrupted worker is killed, and the check is reported as
+    // failed.
+    Solver_interrupt::Scope scope(interrupt, [worker]() {
+      kill(worker->pid, SIGKILL);
+    });
+    failed = !write_message(worker->fd, request, deadline)
+      || !read_message(worker->fd, response, deadline);
+  }
+  if (failed)
+    {
+      // The worker may be hung (e.g., deadlocked, which does not use any
+      // CPU time), so it is killed if it did not respond in time.
+      bool interrupted = interrupt && interrupt->is_interrupted();
+      bool timed_out = get_time() >= deadline;
+      std::string reason = destroy_worker(worker, timed_out);
+      SStats solver_stats;
+      solver_stats.skipped = false;
+      Solver_result result = {Result_status::unknown,
+			      "Analysis failed: " + reason + "\n"};
+      if (interrupted)
+	result.message = "Analysis interrupted\n";
+      return {solver_stats, result};
+    }
+  release_worker(worker);
+
+  size_t pos = 0;
+  Response kind_of_response;
+  get_bytes(response, pos, &kind_of_response, sizeof(kind_of_response));
+  if (kind_of_response == Response::not_implemented)
+    throw Not_implemented(get_string(response, pos));
+
+  SStats solver_stats;
+  get_stats(response, pos, solver_stats);
+  get_stats(response, pos, stats.cvc5);
+  get_stats(response, pos, stats.z3);
+  Solver_result result;
+  get_bytes(response, pos, &result.status, sizeof(result.status));
+  bool has_message;
+  get_bytes(response, pos, &has_message, sizeof(has_message));
+  if (has_message)
+    result.message = get_string(response, pos);
+  return {solver_stats, result};
+}
+
+} // end namespace smtgcc
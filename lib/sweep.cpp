@@ -0,0 +1,139 @@
+// Equivalence sweeping of the check function.
+//
+// The Converter merges identical instructions in src and tgt by CSE, but
+// instructions computing the same value in different ways (such as a+b+c
+// and a+c+b) are still sent to the solver as separate terms. Sweeping
+// evaluates the check function on random inputs to find candidates for
+// instructions that are equal (instructions having different values for
+// some input cannot be equal), proves that they are equal by small solver
+// queries, and merges them.
+//
+// This makes the refinement queries smaller, and the queries are often
+// not needed at all when the merging makes the return values, etc.,
+// identical in src and tgt.
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <tuple>
+
+#include "smtgcc.h"
+
+namespace smtgcc {
+
+namespace {
+
+// Number of inputs used for finding the candidates.
+const int nof_inputs = 256;
+
+// The candidates are proved in chunks of proof_chunk_size candidates, and
+// at most max_proofs candidates are tried. Each proof is limited to
+// proof_rlimit z3 resource units. The limits are deterministic (unlike
+// timeouts), so the swept function does not depend on the machine load.
+const size_t proof_chunk_size = 16;
+const size_t max_proofs = 256;
+const unsigned proof_rlimit = 200000;
+
+// Group the instructions having the same value for all the inputs. The
+// instructions in a group are in the order of the function, so the first
+// instruction dominates the others.
+std::vector<std::vector<Instruction *>> find_groups(Function *func)
+{
+  Inst_map<uint64_t> hashes = simulate(func, nof_inputs);
+  std::map<std::pair<uint32_t, uint64_t>, size_t> key2group;
+  std::vector<std::vector<Instruction *>> groups;
+  for (Instruction *inst = func->bbs[0]->first_inst; inst; inst = inst->next)
+    {
+      if (!hashes.contains(inst))
+	continue;
+      auto key = std::pair(inst->bitsize, hashes.at(inst));
+      auto [it, inserted] = key2group.insert({key, groups.size()});
+      if (inserted)
+	groups.emplace_back();
+      groups[it->second].push_back(inst);
+    }
+  return groups;
+}
+
+// Merge identical instructions. Merging the equal instructions makes
+// instructions using them identical, e.g., the ARRAY_STORE of the equal
+// values.
+void cse(Function *func)
+{
+  using Key = std::tuple<Op, Instruction *, Instruction *, Instruction *>;
+  std::map<Key, Instruction *> key2inst;
+  for (Instruction *inst = func->bbs[0]->first_inst; inst; inst = inst->next)
+    {
+      if (!inst->has_lhs() || inst->opcode == Op::VALUE)
+	continue;
+      assert(inst->nof_args <= 3);
+      Instruction *args[3] = {nullptr, nullptr, nullptr};
+      for (uint16_t i = 0; i < inst->nof_args; i++)
+	args[i] = inst->arguments[i];
+      if (inst->is_commutative() && args[0]->id > args[1]->id)
+	std::swap(args[0], args[1]);
+      Key key = {inst->opcode, args[0], args[1], args[2]};
+      auto [it, inserted] = key2inst.insert({key, inst});
+      if (!inserted)
+	inst->replace_all_uses_with(it->second);
+    }
+}
+
+} // end anonymous namespace
+
+// Merge the instructions in the check function func that are proved to
+// be equal. Returns true if any instruction was merged.
+bool sweep(Function *func)
+{
+  assert(func->bbs.size() == 1);
+
+  // Conditions such as the UB in tgt are often always false, which we can
+  // only find if the constant is in the function.
+  func->value_inst(0, 1);
+  func->value_inst(1, 1);
+
+  std::vector<std::pair<Instruction *, Instruction *>> candidates;
+  for (const auto& group : find_groups(func))
+    {
+      for (size_t i = 1; i < group.size(); i++)
+	candidates.push_back({group[0], group[i]});
+    }
+
+  if (candidates.size() > max_proofs)
+    candidates.resize(max_proofs);
+
+  std::vector<std::pair<Instruction *, Instruction *>> equal;
+  for (size_t first = 0; first < candidates.size(); first += proof_chunk_size)
+    {
+      size_t last = std::min(first + proof_chunk_size, candidates.size());
+      std::vector<std::pair<Instruction *, Instruction *>>
+	chunk(candidates.begin() + first, candidates.begin() + last);
+      std::vector<bool> is_equal;
+      try
+	{
+	  is_equal = check_equal_z3(func, chunk, proof_rlimit);
+	}
+      catch (Not_implemented&)
+	{
+	  break;
+	}
+      for (size_t i = 0; i < chunk.size(); i++)
+	{
+	  if (is_equal[i])
+	    equal.push_back(chunk[i]);
+	}
+    }
+
+  for (auto [inst1, inst2] : equal)
+    inst2->replace_all_uses_with(inst1);
+  if (!equal.empty())
+    cse(func);
+  dead_code_elimination(func);
+  func->canonicalize();
+
+  if (config.verbose > 0 && !equal.empty())
+    fprintf(stderr, "SMTGCC: sweep merged %zu instructions\n", equal.size());
+
+  return !equal.empty();
+}
+
+} // end namespace smtgcc
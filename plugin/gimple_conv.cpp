@@ -40,7 +40,7 @@ unsigned int get_object_alignment(tree exp);
 #define ANON_MEM_SIZE 128
 
 // The maximum number of basic blocks allowed in a function.
-#define MAX_BBS  1000
+#define MAX_BBS  10000
 
 // The maximum number of instructions in one basic block.
 #define MAX_NOF_INSTS  100000
@@ -82,6 +82,10 @@ plugin_init(struct plugin_name_args *plugin_info,
 {
   const char * const plugin_name = plugin_info->base_name;
 
+  // GCC has not created any threads yet, so this is a safe point to fork
+  // the server starting the solver workers.
+  start_worker_server();
+
   struct register_pass_info tv_pass_info;
   tv_pass_info.pass = new tv_pass(g);
   tv_pass_info.reference_pass_name = "ssa";
@@ -1,5 +1,10 @@
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <set>
+#include <thread>
 
 #include "gcc-plugin.h"
 #include "tree-pass.h"
@@ -16,6 +21,8 @@ using namespace smtgcc;
 
 int plugin_is_GPL_compatible;
 
+class tv_queue;
+
 // Function keeping track of the translation validation information for
 // a function.
 struct tv_function
@@ -27,15 +34,66 @@ struct tv_function
   Module *module = nullptr;
   CommonState *state = nullptr;
 
+  // The queue for checking in the background, or nullptr if the checks
+  // are done directly.
+  tv_queue *queue = nullptr;
+
   void check();
   void delete_ir();
 };
 
+// A check that is done by the background threads.
+struct tv_job
+{
+  // The jobs are numbered in the order they are created, and the
+  // diagnostics are emitted in this order.
+  uint64_t seq;
+  tv_function *tv_fun;
+  location_t loc;
+  Check_origin origin;
+  Module *module;
+  size_t size;
+
+  std::optional<std::string> warning;
+  std::optional<std::string> error;
+};
+
+// Queue of checks done by background threads, so the compiler does not
+// need to wait for the SMT solver. The diagnostics are collected and
+// emitted by emit_diagnostics when all checks are done.
+//
+// The memory used by the modules of queued and running jobs is limited
+// by config.async_memory_limit; push blocks until enough jobs have
+// finished when the limit is reached.
+class tv_queue
+{
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable space_cv;
+  std::deque<tv_job *> pending;
+  std::vector<tv_job *> finished;
+  std::vector<std::thread> workers;
+  size_t in_flight_size = 0;
+  size_t max_size;
+  uint64_t next_seq = 0;
+  bool shutting_down = false;
+
+  void worker();
+
+public:
+  tv_queue(int nof_threads);
+  void push(tv_function *tv_fun, location_t loc, const Check_origin& origin,
+	    Module *module);
+  void emit_diagnostics();
+};
+
 struct my_plugin {
   bool has_run_ssa_pass = false;
   bool new_functions_are_ssa = false;
 
   std::map<unsigned int, tv_function *> fun2tvfun;
+
+  tv_queue *queue = nullptr;
 };
 
 // Delete the IR (if any) from the previous pass.
@@ -54,6 +112,16 @@ void tv_function::delete_ir()
   prev_pass_name = "";
 }
 
+static void report_not_implemented(tv_function *tv_fun,
+				   const std::string& msg)
+{
+  if (!tv_fun->errors.contains(msg))
+    {
+      fprintf(stderr, "Not implemented: %s\n", msg.c_str());
+      tv_fun->errors.insert(msg);
+    }
+}
+
 static Function *convert_function(tv_function *tv_fun, const char *name)
 {
   try
@@ -64,50 +132,164 @@ static Function *convert_function(tv_function *tv_fun, const char *name)
     }
   catch (Not_implemented& error)
     {
-      if (!tv_fun->errors.contains(error.msg))
-	{
-	  fprintf(stderr, "Not implemented: %s\n", error.msg.c_str());
-	  tv_fun->errors.insert(error.msg);
-	}
+      report_not_implemented(tv_fun, error.msg);
     }
   return nullptr;
 }
 
+// Check that tgt refines src in module. Returns the message to emit if
+// it does not.
+static std::optional<std::string> check_module(Module *module,
+					       const Check_origin& origin)
+{
+  canonicalize_memory(module);
+  simplify_mem(module);
+  ls_elim(module);
+  simplify_insts(module);
+  dead_code_elimination(module);
+
+  validate(module);
+
+  Solver_result result = check_refine(module, origin);
+  if (result.status == Result_status::correct)
+    return {};
+  assert(result.message);
+  std::string msg = *result.message;
+  msg.pop_back();
+  return msg;
+}
+
 void tv_function::check()
 {
-  try
-    {
-      if (config.verbose > 0)
-	fprintf(stderr, "SMTGCC: Checking %s -> %s : %s\n",
-		prev_pass_name.c_str(), pass_name.c_str(),
-		function_name(cfun));
+  if (config.verbose > 0)
+    fprintf(stderr, "SMTGCC: Checking %s -> %s : %s\n",
+	    prev_pass_name.c_str(), pass_name.c_str(),
+	    function_name(cfun));
 
-      canonicalize_memory(module);
-      simplify_mem(module);
-      ls_elim(module);
-      simplify_insts(module);
-      dead_code_elimination(module);
+  // Most passes do not change a given function, so there is no need
+  // to check the IR when src and tgt are identical.
+  if (module->functions[0]->structural_hash()
+      == module->functions[1]->structural_hash())
+    return;
 
-      validate(module);
+  Check_origin origin = {function_name(cfun),
+			 prev_pass_name + " -> " + pass_name};
+  if (queue)
+    {
+      // The queue takes ownership of the module.
+      queue->push(this, DECL_SOURCE_LOCATION(cfun->decl), origin,
+			  module);
+      module = nullptr;
+      return;
+    }
 
-      Solver_result result = check_refine(module);
-      if (result.status != Result_status::correct)
+  try
+    {
+      if (std::optional<std::string> msg = check_module(module, origin))
 	{
-	  assert(result.message);
-	  std::string warning =
-	    prev_pass_name + " -> " + pass_name + ": " + *result.message;
-	  warning.pop_back();
+	  std::string warning = origin.passes + ": " + *msg;
 	  inform(DECL_SOURCE_LOCATION(cfun->decl), "%s", warning.c_str());
 	}
     }
   catch (Not_implemented& error)
     {
-      if (!errors.contains(error.msg))
+      report_not_implemented(this, error.msg);
+    }
+}
+
+tv_queue::tv_queue(int nof_threads)
+{
+  max_size = (size_t)config.async_memory_limit * 1024 * 1024;
+  for (int i = 0; i < nof_threads; i++)
+    workers.emplace_back([this]() { worker(); });
+}
+
+void tv_queue::worker()
+{
+  for (;;)
+    {
+      tv_job *job;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	work_cv.wait(lock, [this]() {
+	  return !pending.empty() || shutting_down;
+	});
+	if (pending.empty())
+	  return;
+	job = pending.front();
+	pending.pop_front();
+      }
+
+      try
+	{
+	  job->warning = check_module(job->module, job->origin);
+	}
+      catch (Not_implemented& error)
+	{
+	  job->error = error.msg;
+	}
+      destroy_module(job->module);
+      job->module = nullptr;
+
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	in_flight_size -= job->size;
+	finished.push_back(job);
+      }
+      space_cv.notify_all();
+    }
+}
+
+void tv_queue::push(tv_function *tv_fun, location_t loc,
+		    const Check_origin& origin, Module *module)
+{
+  tv_job *job = new tv_job;
+  job->tv_fun = tv_fun;
+  job->loc = loc;
+  job->origin = origin;
+  job->module = module;
+  job->size = module->arena_memory.size();
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    // Wait until there is room for the module. A module larger than the
+    // limit is accepted when nothing else is in flight.
+    space_cv.wait(lock, [this, job]() {
+      return in_flight_size == 0 || in_flight_size + job->size <= max_size;
+    });
+    job->seq = next_seq++;
+    in_flight_size += job->size;
+    pending.push_back(job);
+  }
+  work_cv.notify_one();
+}
+
+void tv_queue::emit_diagnostics()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    shutting_down = true;
+  }
+  work_cv.notify_all();
+  for (auto& thread : workers)
+    thread.join();
+  workers.clear();
+
+  std::sort(finished.begin(), finished.end(), [](tv_job *a, tv_job *b) {
+    return a->seq < b->seq;
+  });
+  for (tv_job *job : finished)
+    {
+      if (job->error)
+	report_not_implemented(job->tv_fun, *job->error);
+      if (job->warning)
 	{
-	  fprintf(stderr, "Not implemented: %s\n", error.msg.c_str());
-	  errors.insert(error.msg);
+	  std::string warning = job->origin.passes + ": " + *job->warning;
+	  inform(job->loc, "%s", warning.c_str());
 	}
+      delete job;
     }
+  finished.clear();
 }
 
 static void ipa_pass(opt_pass *pass, my_plugin *plugin_data)
@@ -144,6 +326,7 @@ static void gimple_pass(opt_pass *pass, my_plugin *plugin_data)
   if (!plugin_data->fun2tvfun.contains(DECL_UID(cfun->decl)))
     {
       tv_fun = new tv_function;
+      tv_fun->queue = plugin_data->queue;
       plugin_data->fun2tvfun[DECL_UID(cfun->decl)] = tv_fun;
       if (plugin_data->new_functions_are_ssa)
 	tv_fun->in_ssa_form = true;
@@ -216,14 +399,28 @@ static void pass_execution(void *event_data, void *data)
     ipa_pass(pass, plugin_data);
 }
 
+static void finish(void *, void *data)
+{
+  my_plugin *plugin_data = (my_plugin *)data;
+  if (plugin_data->queue)
+    plugin_data->queue->emit_diagnostics();
+}
+
 int
 plugin_init(struct plugin_name_args *plugin_info,
 	    [[maybe_unused]] struct plugin_gcc_version *version)
 {
   const char * const plugin_name = plugin_info->base_name;
 
+  // GCC has not created any threads yet, so this is a safe point to fork
+  // the server starting the solver workers.
+  start_worker_server();
+
   my_plugin *mp = new my_plugin;
+  if (config.async_jobs > 0)
+    mp->queue = new tv_queue(config.async_jobs);
   register_callback(plugin_name, PLUGIN_PASS_EXECUTION, pass_execution, (void*)mp);
+  register_callback(plugin_name, PLUGIN_FINISH, finish, (void*)mp);
 
   return 0;
 }
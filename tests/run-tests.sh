@@ -0,0 +1,44 @@
+#!/bin/sh
+# Check the test IR files in tests/check-refine with smtgcc-check-refine.
+#
+# The first line of each test is a comment with the expected result:
+#
+#   ; expect: correct
+#   ; expect: Transformation is not correct (Memory)
+#
+# where the text after "expect:" is compared with the first line of the
+# tool's output ("correct" if there is no output). Each test is checked
+# both with and without the falsifier, so the result does not only come
+# from evaluating the functions on random inputs.
+#
+# Usage: tests/run-tests.sh [path/to/smtgcc-check-refine]
+
+tool=${1:-./smtgcc-check-refine}
+dir=$(dirname "$0")
+failed=0
+total=0
+
+# Do not use results from a cache shared with other runs.
+unset SMTGCC_CACHE_DIR
+
+for test in "$dir"/check-refine/*.ir; do
+  expect=$(sed -n '1s/^; expect: //p' "$test")
+  if [ -z "$expect" ]; then
+    echo "FAIL: $test: missing '; expect:' line"
+    total=$((total + 1))
+    failed=$((failed + 1))
+    continue
+  fi
+  for random_inputs in 256 0; do
+    total=$((total + 1))
+    result=$(SMTGCC_RANDOM_INPUTS=$random_inputs "$tool" "$test" 2>&1 | head -n 1)
+    [ -z "$result" ] && result=correct
+    if [ "$result" != "$expect" ]; then
+      echo "FAIL: $test (SMTGCC_RANDOM_INPUTS=$random_inputs): $result"
+      failed=$((failed + 1))
+    fi
+  done
+done
+
+echo "$((total - failed)) of $total checks passed"
+[ "$failed" -eq 0 ]
@@ -12,6 +12,8 @@ int main(int argc, char **argv)
       exit(1);
     }
 
+  start_worker_server();
+
   try {
     Module *module = parse_ir(argv[1]);
 
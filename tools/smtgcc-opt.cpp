@@ -14,10 +14,12 @@ void print_help(FILE *f)
   const char* help_message = R"(
 Usage: smtgcc-opt [OPTION]... [FILE]
 Perform optimizations on the specified FILE.
+The FILE may be in the text or binary IR format.
 
 Options:
   -h, --help         Display this help message and exit.
   -c                 Check that the optimizations are correct.
+  -binary            Write the result in the binary IR format.
   -simplify_inst     Run instruction simplification optimization.
   -simplify_cfg      Run control flow graph simplification optimization.
   -dce               Run dead code elimination optimization.
@@ -31,6 +33,9 @@ Examples:
   smtgcc-opt -c -simplify_inst -dce example.ir
       Run instructions simplification and dead code elimination optimizations
       on 'example.ir' and check the result of each pass.
+
+  smtgcc-opt -binary example.ir > example.bin
+      Convert 'example.ir' to the binary IR format.
 )";
 
   fprintf(f, "%s", help_message);
@@ -51,6 +56,12 @@ void check(Module *orig_module, Module *module, const char *opt)
 	}
 
       assert(orig_module->functions[i]->name == module->functions[i]->name);
+
+      // Only the functions modified by the pass need to be checked.
+      if (orig_module->functions[i]->structural_hash()
+	  == module->functions[i]->structural_hash())
+	continue;
+
       Module *m = create_module(module->ptr_bits, module->ptr_id_bits,
 				module->ptr_offset_bits);
       Function *src_func = orig_module->functions[i]->clone(m);
@@ -58,7 +69,8 @@ void check(Module *orig_module, Module *module, const char *opt)
       Function *tgt_func = module->functions[i]->clone(m);
       tgt_func->rename("tgt");
 
-      Solver_result result = check_refine(m);
+      Check_origin origin = {module->functions[i]->name, opt};
+      Solver_result result = check_refine(m, origin);
       if (result.status != Result_status::correct)
 	{
 	  assert(result.message);
@@ -77,6 +89,7 @@ int main(int argc, char **argv)
 {
   const char *file_name = nullptr;
   bool flag_c = false;
+  bool flag_binary = false;
 
   for (int i = 1; i < argc; i++)
     {
@@ -94,6 +107,8 @@ int main(int argc, char **argv)
 	print_help(stdout);
       else if (!strcmp(arg, "-c"))
 	flag_c = true;
+      else if (!strcmp(arg, "-binary"))
+	flag_binary = true;
       else if (!strcmp(arg, "-simplify_inst")
 	       || !strcmp(arg, "-simplify_cfg")
 	       || !strcmp(arg, "-dce")
@@ -113,6 +128,9 @@ int main(int argc, char **argv)
       exit(1);
     }
 
+  if (flag_c)
+    start_worker_server();
+
   try {
     Module *module = parse_ir(file_name);
 
@@ -157,7 +175,10 @@ int main(int argc, char **argv)
 	  }
       }
 
-    module->print(stdout);
+    if (flag_binary)
+      write_binary_ir(module, stdout);
+    else
+      module->print(stdout);
 
     destroy_module(module);
   }
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smtgcc.h"
+
+using namespace smtgcc;
+
+namespace fs = std::filesystem;
+
+void print_help(FILE *f)
+{
+  const char* help_message = R"(
+Usage: smtgcc-replay [OPTION]... [FILE|DIR]...
+Solve SMT-LIB2 queries dumped by SMTGCC_DUMP_QUERIES, and report the
+time used. Each DIR is searched for files with the .smt2 extension.
+
+Options:
+  -h, --help         Display this help message and exit.
+  -j N               Solve N queries in parallel (default: 1).
+  -solver SOLVER     Use SOLVER (z3 or cvc5) for solving the queries
+                     (default: z3).
+  -timeout MS        Solver timeout in milliseconds (default: the value
+                     of SMTGCC_TIMEOUT).
+  -v                 Print the result and time for each query.
+
+Examples:
+  SMTGCC_DUMP_QUERIES=queries gcc -O2 -fplugin=smtgcc-tv -c file.c
+  smtgcc-replay -j 8 queries
+      Dump the queries when compiling 'file.c', and solve them again
+      using 8 threads.
+)";
+
+  fprintf(f, "%s", help_message);
+}
+
+struct Query {
+  std::string file_name;
+  std::string category;
+  std::string status;
+  uint64_t time = 0;
+};
+
+// Get the kind of query from the metadata written by dump_queries.
+std::string get_category(const std::string& smt2)
+{
+  std::string check;
+  std::string query;
+  std::istringstream in(smt2);
+  std::string line;
+  while (std::getline(in, line) && line.starts_with(";"))
+    {
+      if (line.starts_with("; check: "))
+	check = line.substr(strlen("; check: "));
+      else if (line.starts_with("; query: "))
+	query = line.substr(strlen("; query: "));
+    }
+  if (check.empty() || query.empty())
+    return "unknown";
+  return check + "/" + query;
+}
+
+void solve(Query& query, bool use_cvc5)
+{
+  std::ifstream in(query.file_name);
+  std::stringstream buf;
+  buf << in.rdbuf();
+  if (!in)
+    {
+      query.status = "error: cannot read the file";
+      return;
+    }
+  std::string smt2 = buf.str();
+  query.category = get_category(smt2);
+
+  uint64_t start_time = get_time();
+  try
+    {
+      Solver_result result =
+	use_cvc5 ? solve_smt2_cvc5(smt2) : solve_smt2_z3(smt2);
+      if (result.status == Result_status::correct)
+	query.status = "unsat";
+      else if (result.status == Result_status::incorrect)
+	query.status = "sat";
+      else
+	query.status = "unknown";
+    }
+  catch (Parse_error error)
+    {
+      query.status = "error: " + error.msg;
+    }
+  catch (Not_implemented error)
+    {
+      query.status = "error: " + error.msg;
+    }
+  query.time = get_time() - start_time;
+}
+
+uint64_t percentile(const std::vector<uint64_t>& times, int p)
+{
+  size_t idx = (times.size() - 1) * p / 100;
+  return times[idx];
+}
+
+void print_summary(const std::string& category,
+		   const std::vector<const Query *>& queries)
+{
+  std::vector<uint64_t> times;
+  std::map<std::string, int> nof_status;
+  uint64_t total = 0;
+  for (const Query *query : queries)
+    {
+      times.push_back(query->time);
+      total += query->time;
+      if (query->status.starts_with("error"))
+	nof_status["error"]++;
+      else
+	nof_status[query->status]++;
+    }
+  std::sort(times.begin(), times.end());
+
+  printf("%s: %zu queries (", category.c_str(), queries.size());
+  const char *sep = "";
+  for (auto [status, nof] : nof_status)
+    {
+      printf("%s%d %s", sep, nof, status.c_str());
+      sep = ", ";
+    }
+  printf(")\n");
+  printf("  time (ms): total %" PRIu64 ", min %" PRIu64 ", median %" PRIu64
+	 ", p90 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\n",
+	 total, times.front(), percentile(times, 50), percentile(times, 90),
+	 percentile(times, 99), times.back());
+}
+
+int main(int argc, char **argv)
+{
+  int nof_threads = 1;
+  bool use_cvc5 = false;
+  bool verbose = false;
+  std::vector<Query> queries;
+
+  for (int i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+      if (!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+	{
+	  print_help(stdout);
+	  exit(0);
+	}
+      else if (!strcmp(arg, "-j") && i + 1 < argc)
+	nof_threads = std::max(atoi(argv[++i]), 1);
+      else if (!strcmp(arg, "-solver") && i + 1 < argc)
+	{
+	  const char *solver = argv[++i];
+	  if (!strcmp(solver, "cvc5"))
+	    use_cvc5 = true;
+	  else if (strcmp(solver, "z3"))
+	    {
+	      print_help(stderr);
+	      exit(1);
+	    }
+	}
+      else if (!strcmp(arg, "-timeout") && i + 1 < argc)
+	config.timeout = atoi(argv[++i]);
+      else if (!strcmp(arg, "-v"))
+	verbose = true;
+      else if (arg[0] == '-')
+	{
+	  print_help(stderr);
+	  exit(1);
+	}
+      else if (fs::is_directory(arg))
+	{
+	  std::vector<std::string> file_names;
+	  for (auto& entry : fs::directory_iterator(arg))
+	    {
+	      if (entry.path().extension() == ".smt2")
+		file_names.push_back(entry.path().string());
+	    }
+	  std::sort(file_names.begin(), file_names.end());
+	  for (auto& file_name : file_names)
+	    queries.push_back({file_name, {}, {}, 0});
+	}
+      else
+	queries.push_back({arg, {}, {}, 0});
+    }
+
+  if (queries.empty())
+    {
+      print_help(stderr);
+      exit(1);
+    }
+
+  std::atomic<size_t> next_query = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nof_threads; i++)
+    {
+      threads.emplace_back([&]() {
+	for (;;)
+	  {
+	    size_t idx = next_query++;
+	    if (idx >= queries.size())
+	      break;
+	    solve(queries[idx], use_cvc5);
+	  }
+      });
+    }
+  for (auto& thread : threads)
+    thread.join();
+
+  std::map<std::string, std::vector<const Query *>> categories;
+  std::vector<const Query *> all_queries;
+  for (const Query& query : queries)
+    {
+      if (verbose || query.status.starts_with("error"))
+	printf("%s: %s %" PRIu64 " ms\n", query.file_name.c_str(),
+	       query.status.c_str(), query.time);
+      categories[query.category].push_back(&query);
+      all_queries.push_back(&query);
+    }
+  for (auto& [category, category_queries] : categories)
+    print_summary(category, category_queries);
+  if (categories.size() > 1)
+    print_summary("total", all_queries);
+
+  return 0;
+}